@@ -0,0 +1,587 @@
+#include "async_io.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define OPT_HAVE_IO_URING 1
+#endif
+
+static IOBackendKind default_io_backend = IOBackendKind::Auto;
+
+void set_default_io_backend(IOBackendKind kind) {
+    default_io_backend = kind;
+}
+
+/**
+ * Fallback backend: a single thread performing blocking pread/pwrite
+ */
+class ThreadBackend : public IOBackend {
+private:
+    std::mutex mutex;
+    std::condition_variable cv_pending;
+    std::condition_variable cv_done;
+    std::deque<IORequest*> pending;
+    std::deque<IORequest*> done;
+    bool stop;
+    std::thread worker;
+
+    static void perform(IORequest* req) {
+        ssize_t res;
+        if (req->write) {
+            res = pwrite(req->fd, req->data, req->length, (off_t)req->offset);
+        }
+        else {
+            res = pread(req->fd, req->data, req->length, (off_t)req->offset);
+        }
+        req->result = res < 0 ? -errno : res;
+    }
+
+    void run() {
+        while (true) {
+            IORequest* req;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv_pending.wait(lock, [this]() {return stop || !pending.empty();});
+                if (pending.empty()) {
+                    return;
+                }
+                req = pending.front();
+                pending.pop_front();
+            }
+            perform(req);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.push_back(req);
+            }
+            cv_done.notify_one();
+        }
+    }
+
+public:
+    ThreadBackend(): stop(false) {
+        worker = std::thread(&ThreadBackend::run, this);
+    }
+
+    ~ThreadBackend() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_pending.notify_one();
+        worker.join();
+    }
+
+    void submit(IORequest* req) override {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(req);
+        }
+        cv_pending.notify_one();
+    }
+
+    IORequest* wait() override {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv_done.wait(lock, [this]() {return !done.empty();});
+        IORequest* req = done.front();
+        done.pop_front();
+        return req;
+    }
+};
+
+#ifdef OPT_HAVE_IO_URING
+
+/**
+ * io_uring backend talking to the kernel directly (no liburing dependency)
+ */
+class UringBackend : public IOBackend {
+private:
+    int ring_fd;
+    void* sq_ring;
+    void* cq_ring;
+    std::size_t sq_ring_size;
+    std::size_t cq_ring_size;
+    io_uring_sqe* sqes;
+    std::size_t sqes_size;
+
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+
+    void unmap() {
+        if (sqes != nullptr) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ring != nullptr && cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring != nullptr) {
+            munmap(sq_ring, sq_ring_size);
+        }
+        if (ring_fd >= 0) {
+            ::close(ring_fd);
+        }
+        ring_fd = -1;
+        sq_ring = cq_ring = sqes = nullptr;
+    }
+
+public:
+    explicit UringBackend(unsigned entries): ring_fd(-1), sq_ring(nullptr), cq_ring(nullptr), sq_ring_size(0),
+                                             cq_ring_size(0), sqes(nullptr), sqes_size(0) {
+        io_uring_params params{};
+        ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0) {
+            return;
+        }
+        // IORING_OP_READ/WRITE appeared together with this feature flag (5.6)
+        if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+            unmap();
+            return;
+        }
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                       IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+            sq_ring = nullptr;
+            unmap();
+            return;
+        }
+        if (single_mmap) {
+            cq_ring = sq_ring;
+        }
+        else {
+            cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                           IORING_OFF_CQ_RING);
+            if (cq_ring == MAP_FAILED) {
+                cq_ring = nullptr;
+                unmap();
+                return;
+            }
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes_ptr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                              IORING_OFF_SQES);
+        if (sqes_ptr == MAP_FAILED) {
+            unmap();
+            return;
+        }
+        sqes = (io_uring_sqe*)sqes_ptr;
+
+        auto sq = (char*)sq_ring;
+        auto cq = (char*)cq_ring;
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + params.sq_off.array);
+        cq_head = (unsigned*)(cq + params.cq_off.head);
+        cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    }
+
+    ~UringBackend() override {
+        unmap();
+    }
+
+    bool ready() const {
+        return ring_fd >= 0;
+    }
+
+    void submit(IORequest* req) override {
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = req->fd;
+        sqe->addr = (unsigned long long)req->data;
+        sqe->len = (unsigned)req->length;
+        sqe->off = req->offset;
+        sqe->user_data = (unsigned long long)req;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        while (syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0) < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+            }
+        }
+    }
+
+    IORequest* wait() override {
+        while (true) {
+            unsigned head = *cq_head;
+            if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe* cqe = &cqes[head & *cq_mask];
+                auto req = (IORequest*)cqe->user_data;
+                req->result = cqe->res;
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                return req;
+            }
+            if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+                errno != EINTR) {
+                throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+            }
+        }
+    }
+};
+
+#endif
+
+std::unique_ptr<IOBackend> IOBackend::create(IOBackendKind kind, unsigned queue_depth) {
+#ifdef OPT_HAVE_IO_URING
+    if (kind != IOBackendKind::Threads) {
+        auto uring = std::make_unique<UringBackend>(queue_depth);
+        if (uring->ready()) {
+            return uring;
+        }
+    }
+#endif
+    return std::make_unique<ThreadBackend>();
+}
+
+AsyncFile::AsyncFile(): fd(-1), head(0), offset(0), error(0), error_write(false) {}
+
+AsyncFile::~AsyncFile() = default;
+
+void AsyncFile::setup(int new_fd, bool write) {
+    fd = new_fd;
+    head = 0;
+    offset = 0;
+    error = 0;
+    if (backend == nullptr) {
+        backend = IOBackend::create(default_io_backend, QUEUE_DEPTH);
+    }
+    if (slots.empty()) {
+        slots.resize(QUEUE_DEPTH);
+        for (Slot& slot : slots) {
+            slot.data = std::make_unique<unsigned char[]>(BUFFER_SIZE);
+        }
+    }
+    for (Slot& slot : slots) {
+        slot.req = IORequest();
+        slot.req.fd = fd;
+        slot.req.write = write;
+        slot.req.data = slot.data.get();
+    }
+}
+
+void AsyncFile::submit(Slot& slot, std::uint64_t pos, std::size_t length) {
+    slot.req.data = slot.data.get();
+    slot.req.offset = pos;
+    slot.req.length = length;
+    slot.req.transferred = 0;
+    slot.req.in_flight = true;
+    backend->submit(&slot.req);
+}
+
+void AsyncFile::complete_one() {
+    IORequest* req = backend->wait();
+    if (req->result < 0) {
+        req->in_flight = false;
+        if (error == 0) {
+            error = (int)-req->result;
+            error_write = req->write;
+        }
+        return;
+    }
+    auto res = (std::size_t)req->result;
+    req->transferred += res;
+    // Short transfer: continue with the rest of the buffer (a read of 0 bytes is the end of the file)
+    if (res > 0 && res < req->length) {
+        req->data += res;
+        req->offset += res;
+        req->length -= res;
+        backend->submit(req);
+        return;
+    }
+    req->in_flight = false;
+}
+
+void AsyncFile::wait_slot(Slot& slot) {
+    while (slot.req.in_flight) {
+        complete_one();
+    }
+    check_error();
+}
+
+/**
+ * Wait for all requests in flight without throwing, the first error is kept
+ * If the backend itself fails, it is destroyed, which cancels the remaining requests
+ */
+void AsyncFile::wait_all() noexcept {
+    try {
+        for (Slot& slot : slots) {
+            while (slot.req.in_flight) {
+                complete_one();
+            }
+        }
+    }
+    catch (const std::system_error& e) {
+        if (error == 0) {
+            error = e.code().value();
+            error_write = slots.front().req.write;
+        }
+        backend.reset();
+        for (Slot& slot : slots) {
+            slot.req.in_flight = false;
+        }
+    }
+}
+
+void AsyncFile::check_error() const {
+    if (error != 0) {
+        throw std::system_error(error, std::generic_category(), error_write ? "async write" : "async read");
+    }
+}
+
+void AsyncFile::finish() {
+    wait_all();
+    release();
+    check_error();
+}
+
+void AsyncFile::discard() noexcept {
+    wait_all();
+    release();
+    error = 0;
+}
+
+void AsyncFile::release() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    fd = -1;
+}
+
+bool AsyncFile::is_open() const {
+    return fd >= 0;
+}
+
+AsyncReader::AsyncReader(): file_size(0), next_offset(0), pos(0), avail(0), has_slot(false) {}
+
+AsyncReader::~AsyncReader() {
+    discard();
+}
+
+/**
+ * Give a free buffer the next part of the file
+ * @param slot Buffer
+ */
+void AsyncReader::schedule(Slot& slot) {
+    if (next_offset >= file_size) {
+        return;
+    }
+    std::size_t length = std::min<std::uint64_t>(BUFFER_SIZE, file_size - next_offset);
+    submit(slot, next_offset, length);
+    next_offset += length;
+}
+
+void AsyncReader::start() {
+    next_offset = 0;
+    head = 0;
+    pos = 0;
+    avail = 0;
+    has_slot = false;
+    for (Slot& slot : slots) {
+        slot.req.transferred = 0;
+        schedule(slot);
+    }
+}
+
+void AsyncReader::open(const std::string& filename) {
+    discard();
+    int new_fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (new_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + filename);
+    }
+    struct stat st{};
+    if (fstat(new_fd, &st) != 0) {
+        int fstat_error = errno;
+        ::close(new_fd);
+        throw std::system_error(fstat_error, std::generic_category(), "stat " + filename);
+    }
+    setup(new_fd, false);
+    file_size = (std::uint64_t)st.st_size;
+    start();
+}
+
+void AsyncReader::close() {
+    if (!is_open()) {
+        return;
+    }
+    file_size = 0;
+    pos = avail = 0;
+    has_slot = false;
+    finish();
+}
+
+/**
+ * Move to the next buffer, recycling the consumed one for read-ahead
+ * @return False at the end of the file
+ */
+bool AsyncReader::fill() {
+    if (!is_open()) {
+        return false;
+    }
+    if (has_slot) {
+        Slot& consumed = slots[head];
+        consumed.req.transferred = 0;
+        schedule(consumed);
+        head = (head + 1) % slots.size();
+        has_slot = false;
+    }
+    Slot& slot = slots[head];
+    wait_slot(slot);
+    pos = 0;
+    avail = slot.req.transferred;
+    if (avail == 0) {
+        return false;
+    }
+    has_slot = true;
+    return true;
+}
+
+bool AsyncReader::get(char& byte) {
+    if (pos == avail && !fill()) {
+        return false;
+    }
+    byte = (char)slots[head].data[pos++];
+    return true;
+}
+
+std::size_t AsyncReader::read(char* dst, std::size_t n) {
+    std::size_t done = 0;
+    while (done < n) {
+        if (pos == avail && !fill()) {
+            break;
+        }
+        std::size_t part = std::min(n - done, avail - pos);
+        std::memcpy(dst + done, slots[head].data.get() + pos, part);
+        pos += part;
+        done += part;
+    }
+    return done;
+}
+
+void AsyncReader::rewind() {
+    if (!is_open()) {
+        return;
+    }
+    wait_all();
+    check_error();
+    start();
+}
+
+std::uint64_t AsyncReader::size() const {
+    return file_size;
+}
+
+AsyncWriter::AsyncWriter(): fill(0) {}
+
+AsyncWriter::~AsyncWriter() {
+    if (!is_open()) {
+        return;
+    }
+    try {
+        submit_fill();
+    }
+    catch (const std::system_error&) {
+        // The backend has failed, discard() cancels the requests
+    }
+    discard();
+}
+
+void AsyncWriter::open(const std::string& filename) {
+    discard();
+    int new_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (new_fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + filename);
+    }
+    setup(new_fd, true);
+    fill = 0;
+}
+
+/**
+ * Send the current buffer to the disk without waiting
+ */
+void AsyncWriter::submit_fill() {
+    if (fill == 0) {
+        return;
+    }
+    submit(slots[head], offset, fill);
+    offset += fill;
+    fill = 0;
+    head = (head + 1) % slots.size();
+}
+
+/**
+ * Send the current buffer to the disk and take the next free one
+ */
+void AsyncWriter::flush_slot() {
+    if (fill == 0) {
+        return;
+    }
+    submit_fill();
+    wait_slot(slots[head]);
+}
+
+void AsyncWriter::close() {
+    if (!is_open()) {
+        return;
+    }
+    try {
+        submit_fill();
+    }
+    catch (const std::system_error&) {
+        discard();
+        throw;
+    }
+    finish();
+}
+
+void AsyncWriter::write(const char* src, std::size_t n) {
+    if (!is_open()) {
+        return;
+    }
+    while (n > 0) {
+        std::size_t part = std::min(n, BUFFER_SIZE - fill);
+        std::memcpy(slots[head].data.get() + fill, src, part);
+        fill += part;
+        src += part;
+        n -= part;
+        if (fill == BUFFER_SIZE) {
+            flush_slot();
+        }
+    }
+}
+
+void AsyncWriter::put(char byte) {
+    if (!is_open()) {
+        return;
+    }
+    slots[head].data[fill++] = (unsigned char)byte;
+    if (fill == BUFFER_SIZE) {
+        flush_slot();
+    }
+}
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Which implementation carries the asynchronous reads and writes
+ */
+enum class IOBackendKind {
+    Auto,    // io_uring if the kernel supports it, otherwise Threads
+    Uring,   // Linux io_uring (falls back to Threads if it cannot be set up)
+    Threads  // blocking pread/pwrite on a background thread
+};
+
+/**
+ * Select the backend used by readers and writers opened after this call
+ * @param kind Backend kind
+ */
+void set_default_io_backend(IOBackendKind kind);
+
+/**
+ * One read or write in flight
+ */
+struct IORequest {
+    int fd = -1;
+    bool write = false;
+    unsigned char* data = nullptr;
+    std::size_t length = 0;
+    std::uint64_t offset = 0;
+    // Filled by the backend: bytes transferred by the last submission or -errno
+    long long result = 0;
+    // Bookkeeping of the owner
+    std::size_t transferred = 0;
+    bool in_flight = false;
+};
+
+/**
+ * Submission/completion interface shared by io_uring and the thread fallback
+ */
+class IOBackend {
+public:
+    virtual ~IOBackend() = default;
+
+    /**
+     * Queue a request, it must stay alive until it is returned by wait()
+     * @param req Request
+     */
+    virtual void submit(IORequest* req) = 0;
+
+    /**
+     * Block until any submitted request completes
+     * @return Completed request
+     */
+    virtual IORequest* wait() = 0;
+
+    /**
+     * Create a backend
+     * @param kind Requested kind
+     * @param queue_depth Maximal number of requests in flight
+     * @return Backend
+     */
+    static std::unique_ptr<IOBackend> create(IOBackendKind kind, unsigned queue_depth);
+};
+
+/**
+ * Common part of reader and writer: ring of buffers with requests in flight
+ */
+class AsyncFile {
+protected:
+    struct Slot {
+        std::unique_ptr<unsigned char[]> data;
+        IORequest req;
+    };
+
+    int fd;
+    std::unique_ptr<IOBackend> backend;
+    std::vector<Slot> slots;
+    std::size_t head;
+    std::uint64_t offset;
+    // First failed request since the file was opened: errno and its direction, 0 - no error
+    int error;
+    bool error_write;
+
+    AsyncFile();
+
+    ~AsyncFile();
+
+    void setup(int new_fd, bool write);
+
+    void submit(Slot& slot, std::uint64_t pos, std::size_t length);
+
+    /**
+     * Wait for one completion and resubmit it if it was short, a failed request is remembered in error
+     */
+    void complete_one();
+
+    /**
+     * Wait for the request of the buffer, throws std::system_error if any request has failed
+     * @param slot Buffer
+     */
+    void wait_slot(Slot& slot);
+
+    /**
+     * Wait for all requests in flight without throwing, the first error is kept
+     */
+    void wait_all() noexcept;
+
+    /**
+     * Throw std::system_error for the first failed request, if there is one
+     */
+    void check_error() const;
+
+    /**
+     * Wait for all requests and close the file, throws std::system_error if any request has failed
+     */
+    void finish();
+
+    /**
+     * Wait for all requests and close the file, errors are dropped
+     */
+    void discard() noexcept;
+
+    void release();
+
+public:
+    // Size of each buffer and number of buffers in flight
+    static constexpr std::size_t BUFFER_SIZE = 1 << 20;
+    static constexpr unsigned QUEUE_DEPTH = 4;
+
+    AsyncFile(const AsyncFile&) = delete;
+
+    AsyncFile& operator=(const AsyncFile&) = delete;
+
+    bool is_open() const;
+};
+
+/**
+ * Sequential file reader which keeps several read-ahead buffers in flight
+ */
+class AsyncReader : public AsyncFile {
+private:
+    std::uint64_t file_size;
+    std::uint64_t next_offset;
+    std::size_t pos;
+    std::size_t avail;
+    bool has_slot;
+
+    void schedule(Slot& slot);
+
+    void start();
+
+    bool fill();
+
+public:
+    AsyncReader();
+
+    /**
+     * Errors of the requests in flight are dropped, close() reports them
+     */
+    ~AsyncReader();
+
+    /**
+     * Open the file for reading, throws std::system_error if it can't be opened
+     * @param filename Name of the file
+     */
+    void open(const std::string& filename);
+
+    /**
+     * Close the file, throws std::system_error if a read has failed
+     */
+    void close();
+
+    /**
+     * Read one byte
+     * @param byte Destination
+     * @return False at the end of the file
+     */
+    bool get(char& byte);
+
+    /**
+     * Read up to n bytes
+     * @param dst Destination
+     * @param n Number of bytes
+     * @return Number of bytes read (less than n only at the end of the file)
+     */
+    std::size_t read(char* dst, std::size_t n);
+
+    /**
+     * Start reading from the beginning of the file again
+     */
+    void rewind();
+
+    std::uint64_t size() const;
+};
+
+/**
+ * Sequential file writer which keeps several write-behind buffers in flight
+ */
+class AsyncWriter : public AsyncFile {
+private:
+    std::size_t fill;
+
+    void flush_slot();
+
+    /**
+     * Send the current buffer to the disk without waiting
+     */
+    void submit_fill();
+
+public:
+    AsyncWriter();
+
+    /**
+     * The buffered data is written, errors are dropped, close() reports them
+     */
+    ~AsyncWriter();
+
+    /**
+     * Create or truncate the file for writing, throws std::system_error if it can't be opened
+     * @param filename Name of the file
+     */
+    void open(const std::string& filename);
+
+    /**
+     * Write the buffered data and close the file, throws std::system_error if a write has failed
+     */
+    void close();
+
+    void write(const char* src, std::size_t n);
+
+    void put(char byte);
+};
@@ -0,0 +1,453 @@
+#include "checksum.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/**
+ * Tables for the software CRC-32C: table[k][b] is the checksum of the byte b followed by k zero bytes
+ */
+struct CRC32CTables {
+    std::uint32_t table[8][256];
+
+    CRC32CTables(): table() {
+        for (std::uint32_t b = 0; b < 256; b++) {
+            std::uint32_t crc = b;
+            for (int i = 0; i < 8; i++) {
+                crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+            }
+            table[0][b] = crc;
+        }
+        for (std::uint32_t b = 0; b < 256; b++) {
+            for (int k = 1; k < 8; k++) {
+                table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 255];
+            }
+        }
+    }
+};
+
+/**
+ * Slicing-by-8: eight table lookups for eight bytes
+ */
+static std::uint32_t crc32c_software(std::uint32_t crc, const unsigned char* data, std::size_t size) {
+    static const CRC32CTables tables;
+    const auto& t = tables.table;
+    for (; size >= 8; data += 8, size -= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, data, 8);
+        word ^= crc;
+        crc = t[7][word & 255] ^ t[6][(word >> 8) & 255] ^ t[5][(word >> 16) & 255] ^ t[4][(word >> 24) & 255] ^
+              t[3][(word >> 32) & 255] ^ t[2][(word >> 40) & 255] ^ t[1][(word >> 48) & 255] ^ t[0][word >> 56];
+    }
+    for (; size > 0; data++, size--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data) & 255];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * Table which moves the checksum over the given number of zero bytes:
+ * the checksum of A followed by B is shift(crc(A)) ^ crc(B), where B starts from zero
+ */
+struct CRC32CShift {
+    std::uint32_t table[4][256];
+
+    explicit CRC32CShift(std::size_t bytes): table() {
+        static const unsigned char zeros[64] = {};
+        std::uint32_t bit_shift[32];
+        for (int bit = 0; bit < 32; bit++) {
+            std::uint32_t crc = (std::uint32_t)1 << bit;
+            for (std::size_t left = bytes; left > 0; left -= std::min<std::size_t>(left, sizeof(zeros))) {
+                crc = crc32c_software(crc, zeros, std::min<std::size_t>(left, sizeof(zeros)));
+            }
+            bit_shift[bit] = crc;
+        }
+        for (int k = 0; k < 4; k++) {
+            for (std::uint32_t b = 0; b < 256; b++) {
+                for (int bit = 0; bit < 8; bit++) {
+                    if (b & (1u << bit)) {
+                        table[k][b] ^= bit_shift[8 * k + bit];
+                    }
+                }
+            }
+        }
+    }
+
+    std::uint32_t operator() (std::uint32_t crc) const {
+        return table[0][crc & 255] ^ table[1][(crc >> 8) & 255] ^ table[2][(crc >> 16) & 255] ^ table[3][crc >> 24];
+    }
+};
+
+/**
+ * The crc32 instruction has latency 3 and throughput 1, so three independent lanes are computed
+ * and then combined with the shift tables
+ */
+__attribute__((target("sse4.2")))
+static std::uint32_t crc32c_hardware(std::uint32_t crc, const unsigned char* data, std::size_t size) {
+    const std::size_t LANE = 4096;
+    static const CRC32CShift shift(LANE);
+    std::uint64_t crc64 = crc;
+    for (; size >= 3 * LANE; data += 3 * LANE, size -= 3 * LANE) {
+        std::uint64_t crc1 = 0;
+        std::uint64_t crc2 = 0;
+        for (std::size_t i = 0; i < LANE; i += 8) {
+            std::uint64_t w0, w1, w2;
+            std::memcpy(&w0, data + i, 8);
+            std::memcpy(&w1, data + LANE + i, 8);
+            std::memcpy(&w2, data + 2 * LANE + i, 8);
+            crc64 = _mm_crc32_u64(crc64, w0);
+            crc1 = _mm_crc32_u64(crc1, w1);
+            crc2 = _mm_crc32_u64(crc2, w2);
+        }
+        crc64 = shift((std::uint32_t)crc64) ^ (std::uint32_t)crc1;
+        crc64 = shift((std::uint32_t)crc64) ^ (std::uint32_t)crc2;
+    }
+    for (; size >= 8; data += 8, size -= 8) {
+        std::uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (std::uint32_t)crc64;
+    for (; size > 0; data++, size--) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+/**
+ * CRC-32C (Castagnoli), uses the SSE4.2 crc32 instruction when the CPU has it
+ * @param crc Checksum of the previous data (0 at the beginning)
+ * @param data Data
+ * @param size Size of the data
+ * @return Checksum of the previous data followed by this data
+ */
+std::uint32_t crc32c(std::uint32_t crc, const unsigned char* data, std::size_t size) {
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return ~crc32c_hardware(~crc, data, size);
+    }
+#endif
+    return ~crc32c_software(~crc, data, size);
+}
+
+static const std::uint64_t XXH_P1 = 0x9e3779b185ebca87ull;
+static const std::uint64_t XXH_P2 = 0xc2b2ae3d27d4eb4full;
+static const std::uint64_t XXH_P3 = 0x165667b19e3779f9ull;
+static const std::uint64_t XXH_P4 = 0x85ebca77c2b2ae63ull;
+static const std::uint64_t XXH_P5 = 0x27d4eb2f165667c5ull;
+
+static std::uint64_t xxh_round(std::uint64_t acc, std::uint64_t input) {
+    acc += input * XXH_P2;
+    acc = std::rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static std::uint64_t xxh_merge(std::uint64_t h, std::uint64_t acc) {
+    h ^= xxh_round(0, acc);
+    return h * XXH_P1 + XXH_P4;
+}
+
+static std::uint64_t read64(const unsigned char* p) {
+    std::uint64_t x;
+    std::memcpy(&x, p, 8);
+    return x;
+}
+
+static std::uint32_t read32(const unsigned char* p) {
+    std::uint32_t x;
+    std::memcpy(&x, p, 4);
+    return x;
+}
+
+XXHash64::XXHash64(): acc{XXH_P1 + XXH_P2, XXH_P2, 0, 0 - XXH_P1}, buffer(), buffer_fill(0), total(0) {}
+
+void XXHash64::update(const unsigned char* data, std::size_t size) {
+    total += size;
+    if (buffer_fill > 0) {
+        std::size_t part = std::min(size, sizeof(buffer) - buffer_fill);
+        std::memcpy(buffer + buffer_fill, data, part);
+        buffer_fill += part;
+        data += part;
+        size -= part;
+        if (buffer_fill < sizeof(buffer)) {
+            return;
+        }
+        for (int i = 0; i < 4; i++) {
+            acc[i] = xxh_round(acc[i], read64(buffer + 8 * i));
+        }
+        buffer_fill = 0;
+    }
+    // Four independent lanes of 8 bytes
+    std::uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+    for (; size >= 32; data += 32, size -= 32) {
+        a0 = xxh_round(a0, read64(data));
+        a1 = xxh_round(a1, read64(data + 8));
+        a2 = xxh_round(a2, read64(data + 16));
+        a3 = xxh_round(a3, read64(data + 24));
+    }
+    acc[0] = a0;
+    acc[1] = a1;
+    acc[2] = a2;
+    acc[3] = a3;
+    std::memcpy(buffer, data, size);
+    buffer_fill = size;
+}
+
+std::uint64_t XXHash64::digest() const {
+    std::uint64_t h;
+    if (total >= 32) {
+        h = std::rotl(acc[0], 1) + std::rotl(acc[1], 7) + std::rotl(acc[2], 12) + std::rotl(acc[3], 18);
+        for (std::uint64_t a : acc) {
+            h = xxh_merge(h, a);
+        }
+    }
+    else {
+        h = XXH_P5;
+    }
+    h += total;
+
+    const unsigned char* p = buffer;
+    std::size_t rest = buffer_fill;
+    for (; rest >= 8; p += 8, rest -= 8) {
+        h ^= xxh_round(0, read64(p));
+        h = std::rotl(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (rest >= 4) {
+        h ^= (std::uint64_t)read32(p) * XXH_P1;
+        h = std::rotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        rest -= 4;
+    }
+    for (; rest > 0; p++, rest--) {
+        h ^= *p * XXH_P5;
+        h = std::rotl(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+Checksum::Checksum(ChecksumKind kind_): kind(kind_), crc(0) {}
+
+/**
+ * Start a new checksum of the same kind
+ */
+void Checksum::reset() {
+    crc = 0;
+    xxh = XXHash64();
+}
+
+void Checksum::update(const unsigned char* data, std::size_t size) {
+    if (kind == ChecksumKind::CRC32C) {
+        crc = crc32c(crc, data, size);
+    }
+    else if (kind == ChecksumKind::XXH64) {
+        xxh.update(data, size);
+    }
+}
+
+std::uint64_t Checksum::value() const {
+    if (kind == ChecksumKind::CRC32C) {
+        return crc;
+    }
+    if (kind == ChecksumKind::XXH64) {
+        return xxh.digest();
+    }
+    return 0;
+}
+
+/**
+ * Size of the stored value: 0, 4 or 8 bytes
+ */
+std::size_t Checksum::size() const {
+    if (kind == ChecksumKind::CRC32C) {
+        return 4;
+    }
+    if (kind == ChecksumKind::XXH64) {
+        return 8;
+    }
+    return 0;
+}
+
+/**
+ * Write the value (little-endian, size() bytes)
+ * @param file_out File
+ */
+void Checksum::write(AsyncWriter& file_out) const {
+    unsigned char stored[8];
+    std::uint64_t x = value();
+    for (std::size_t i = 0; i < size(); i++) {
+        stored[i] = (unsigned char)(x >> (8 * i));
+    }
+    file_out.write((char*)stored, size());
+}
+
+/**
+ * Append the value (little-endian, size() bytes)
+ * @param out Result is appended here
+ */
+void Checksum::write(std::vector<unsigned char>& out) const {
+    std::uint64_t x = value();
+    for (std::size_t i = 0; i < size(); i++) {
+        out.push_back((unsigned char)(x >> (8 * i)));
+    }
+}
+
+/**
+ * Read the stored value and compare it with the current one
+ * @param file_in File
+ * @return False if the value is missing or different
+ */
+bool Checksum::check(AsyncReader& file_in) const {
+    unsigned char stored[8];
+    if (file_in.read((char*)stored, size()) != size()) {
+        return false;
+    }
+    return check(stored);
+}
+
+/**
+ * Compare the stored value with the current one
+ * @param stored Stored value, size() bytes
+ * @return False if the value is different
+ */
+bool Checksum::check(const unsigned char* stored) const {
+    std::uint64_t x = 0;
+    for (std::size_t i = 0; i < size(); i++) {
+        x |= (std::uint64_t)stored[i] << (8 * i);
+    }
+    return x == value();
+}
+
+static const std::uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+SHA256::SHA256(): state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+                  block(), block_fill(0), total(0) {}
+
+/**
+ * Process one 64-byte block
+ * @param chunk Block
+ */
+void SHA256::compress(const unsigned char* chunk) {
+    std::uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (std::uint32_t)chunk[4 * i] << 24 | (std::uint32_t)chunk[4 * i + 1] << 16 |
+               (std::uint32_t)chunk[4 * i + 2] << 8 | (std::uint32_t)chunk[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        std::uint32_t s0 = std::rotr(w[i - 15], 7) ^ std::rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        std::uint32_t s1 = std::rotr(w[i - 2], 17) ^ std::rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    std::uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        std::uint32_t s1 = std::rotr(e, 6) ^ std::rotr(e, 11) ^ std::rotr(e, 25);
+        std::uint32_t ch = (e & f) ^ (~e & g);
+        std::uint32_t t1 = h + s1 + ch + SHA256_K[i] + w[i];
+        std::uint32_t s0 = std::rotr(a, 2) ^ std::rotr(a, 13) ^ std::rotr(a, 22);
+        std::uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        std::uint32_t t2 = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+/**
+ * Add data to the hash
+ * @param data Data
+ * @param size Size of the data
+ */
+void SHA256::update(const unsigned char* data, std::size_t size) {
+    total += size;
+    if (block_fill > 0) {
+        std::size_t part = std::min(size, sizeof(block) - block_fill);
+        std::memcpy(block + block_fill, data, part);
+        block_fill += part;
+        data += part;
+        size -= part;
+        if (block_fill < sizeof(block)) {
+            return;
+        }
+        compress(block);
+        block_fill = 0;
+    }
+    // Whole blocks are processed in place
+    for (; size >= sizeof(block); data += sizeof(block), size -= sizeof(block)) {
+        compress(data);
+    }
+    std::memcpy(block, data, size);
+    block_fill = size;
+}
+
+/**
+ * Finish the hash: padding with 1 bit, zeros and the length in bits
+ * @param out Digest, DIGEST_SIZE bytes
+ */
+void SHA256::digest(unsigned char* out) {
+    std::uint64_t bits = total * 8;
+    block[block_fill++] = 0x80;
+    if (block_fill > sizeof(block) - 8) {
+        std::memset(block + block_fill, 0, sizeof(block) - block_fill);
+        compress(block);
+        block_fill = 0;
+    }
+    std::memset(block + block_fill, 0, sizeof(block) - 8 - block_fill);
+    for (int i = 0; i < 8; i++) {
+        block[sizeof(block) - 1 - i] = (unsigned char)(bits >> (8 * i));
+    }
+    compress(block);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (unsigned char)(state[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(state[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(state[i] >> 8);
+        out[4 * i + 3] = (unsigned char)state[i];
+    }
+}
+
+/**
+ * Hash of the buffer
+ * @param data Data
+ * @param size Size of the data
+ * @param out Digest, DIGEST_SIZE bytes
+ */
+void SHA256::hash(const unsigned char* data, std::size_t size, unsigned char* out) {
+    SHA256 sha;
+    sha.update(data, size);
+    sha.digest(out);
+}
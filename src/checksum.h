@@ -0,0 +1,137 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "async_io.h"
+
+/**
+ * Checksum of the blocks and of the whole stream
+ */
+enum class ChecksumKind : unsigned {
+    None = 0,
+    CRC32C = 1,
+    XXH64 = 2
+};
+
+/**
+ * CRC-32C (Castagnoli), uses the SSE4.2 crc32 instruction when the CPU has it
+ * @param crc Checksum of the previous data (0 at the beginning)
+ * @param data Data
+ * @param size Size of the data
+ * @return Checksum of the previous data followed by this data
+ */
+std::uint32_t crc32c(std::uint32_t crc, const unsigned char* data, std::size_t size);
+
+/**
+ * xxHash64 with seed 0
+ */
+class XXHash64 {
+private:
+    std::uint64_t acc[4];
+    unsigned char buffer[32];
+    std::size_t buffer_fill;
+    std::uint64_t total;
+
+public:
+    XXHash64();
+
+    void update(const unsigned char* data, std::size_t size);
+
+    std::uint64_t digest() const;
+};
+
+/**
+ * Running checksum of the chosen kind
+ */
+class Checksum {
+private:
+    ChecksumKind kind;
+    std::uint32_t crc;
+    XXHash64 xxh;
+
+public:
+    explicit Checksum(ChecksumKind kind_ = ChecksumKind::None);
+
+    /**
+     * Start a new checksum of the same kind
+     */
+    void reset();
+
+    void update(const unsigned char* data, std::size_t size);
+
+    std::uint64_t value() const;
+
+    /**
+     * Size of the stored value: 0, 4 or 8 bytes
+     */
+    std::size_t size() const;
+
+    /**
+     * Write the value (little-endian, size() bytes)
+     * @param file_out File
+     */
+    void write(AsyncWriter& file_out) const;
+
+    /**
+     * Append the value (little-endian, size() bytes)
+     * @param out Result is appended here
+     */
+    void write(std::vector<unsigned char>& out) const;
+
+    /**
+     * Read the stored value and compare it with the current one
+     * @param file_in File
+     * @return False if the value is missing or different
+     */
+    bool check(AsyncReader& file_in) const;
+
+    /**
+     * Compare the stored value with the current one
+     * @param stored Stored value, size() bytes
+     * @return False if the value is different
+     */
+    bool check(const unsigned char* stored) const;
+};
+
+/**
+ * SHA-256 (FIPS 180-4), used as a strong key of the data
+ */
+class SHA256 {
+private:
+    std::uint32_t state[8];
+    unsigned char block[64];
+    std::size_t block_fill;
+    std::uint64_t total;
+
+    /**
+     * Process one 64-byte block
+     * @param chunk Block
+     */
+    void compress(const unsigned char* chunk);
+
+public:
+    static constexpr std::size_t DIGEST_SIZE = 32;
+
+    SHA256();
+
+    /**
+     * Add data to the hash
+     * @param data Data
+     * @param size Size of the data
+     */
+    void update(const unsigned char* data, std::size_t size);
+
+    /**
+     * Finish the hash, the object must not be updated after it
+     * @param out Digest, DIGEST_SIZE bytes
+     */
+    void digest(unsigned char* out);
+
+    /**
+     * Hash of the buffer
+     * @param data Data
+     * @param size Size of the data
+     * @param out Digest, DIGEST_SIZE bytes
+     */
+    static void hash(const unsigned char* data, std::size_t size, unsigned char* out);
+};
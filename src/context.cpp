@@ -0,0 +1,73 @@
+#include "context.h"
+
+#include <algorithm>
+
+Arena::Arena(): current(0), used(0) {}
+
+void* Arena::allocate_bytes(std::size_t size, std::size_t alignment) {
+    while (current < chunks.size()) {
+        std::size_t offset = (used + alignment - 1) & ~(alignment - 1);
+        if (offset + size <= chunks[current].size) {
+            used = offset + size;
+            return chunks[current].data.get() + offset;
+        }
+        current++;
+        used = 0;
+    }
+    // New chunk is at least as large as everything before it, so the number of chunks stays small
+    std::size_t chunk_size = std::max({size + alignment, MIN_CHUNK_SIZE, capacity()});
+    chunks.push_back({std::make_unique_for_overwrite<unsigned char[]>(chunk_size), chunk_size});
+    current = chunks.size() - 1;
+    used = size;
+    return chunks[current].data.get();
+}
+
+/**
+ * Free everything allocated so far, the memory is merged into one chunk and kept
+ */
+void Arena::reset() {
+    if (chunks.size() > 1) {
+        std::size_t total = capacity();
+        chunks.clear();
+        chunks.push_back({std::make_unique_for_overwrite<unsigned char[]>(total), total});
+    }
+    current = 0;
+    used = 0;
+}
+
+std::size_t Arena::capacity() const {
+    std::size_t total = 0;
+    for (const Chunk& chunk : chunks) {
+        total += chunk.size;
+    }
+    return total;
+}
+
+BufferPool::Buffer::Buffer(BufferPool* pool_, std::vector<unsigned char>&& data_): pool(pool_), data(std::move(data_)) {}
+
+BufferPool::Buffer::Buffer(Buffer&& other) noexcept: pool(std::exchange(other.pool, nullptr)), data(std::move(other.data)) {}
+
+BufferPool::Buffer::~Buffer() {
+    if (pool != nullptr) {
+        pool->free_buffers.push_back(std::move(data));
+    }
+}
+
+/**
+ * Take a buffer, the largest one is preferred
+ * @param size Size of the buffer, the content is unspecified
+ * @return Buffer
+ */
+BufferPool::Buffer BufferPool::acquire(std::size_t size) {
+    std::vector<unsigned char> data;
+    if (!free_buffers.empty()) {
+        auto largest = std::max_element(free_buffers.begin(), free_buffers.end(), [](const auto& a, const auto& b) {
+            return a.capacity() < b.capacity();
+        });
+        data = std::move(*largest);
+        *largest = std::move(free_buffers.back());
+        free_buffers.pop_back();
+    }
+    data.resize(size);
+    return Buffer(this, std::move(data));
+}
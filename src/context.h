@@ -0,0 +1,121 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Bump allocator for scratch arrays of a block
+ * Memory is kept after reset, so the next block of the same size doesn't allocate
+ */
+class Arena {
+private:
+    static constexpr std::size_t MIN_CHUNK_SIZE = 1 << 16;
+
+    struct Chunk {
+        std::unique_ptr<unsigned char[]> data;
+        std::size_t size;
+    };
+
+    std::vector<Chunk> chunks;
+    std::size_t current;
+    std::size_t used;
+
+    void* allocate_bytes(std::size_t size, std::size_t alignment);
+
+public:
+    Arena();
+
+    Arena(const Arena&) = delete;
+
+    Arena& operator=(const Arena&) = delete;
+
+    /**
+     * Uninitialized array, valid until reset
+     * @param n Number of elements
+     * @return Array
+     */
+    template <typename T>
+    std::span<T> allocate(std::size_t n) {
+        static_assert(std::is_trivially_destructible_v<T>, "Arena doesn't call destructors");
+        return std::span<T>(static_cast<T*>(allocate_bytes(n * sizeof(T), alignof(T))), n);
+    }
+
+    /**
+     * Object constructed in the arena, valid until reset
+     * @param args Arguments of the constructor
+     * @return Object
+     */
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>, "Arena doesn't call destructors");
+        return new (allocate_bytes(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    /**
+     * Free everything allocated so far, the memory is merged into one chunk and kept
+     */
+    void reset();
+
+    std::size_t capacity() const;
+};
+
+/**
+ * Pool of byte buffers which keep their capacity between blocks and calls
+ */
+class BufferPool {
+private:
+    std::vector<std::vector<unsigned char>> free_buffers;
+
+public:
+    /**
+     * Buffer taken from the pool, it goes back when the handle is destroyed
+     */
+    class Buffer {
+    private:
+        BufferPool* pool;
+        std::vector<unsigned char> data;
+
+    public:
+        Buffer(BufferPool* pool_, std::vector<unsigned char>&& data_);
+
+        Buffer(Buffer&& other) noexcept;
+
+        Buffer& operator=(Buffer&&) = delete;
+
+        ~Buffer();
+
+        std::vector<unsigned char>& operator*() {
+            return data;
+        }
+
+        std::vector<unsigned char>* operator->() {
+            return &data;
+        }
+    };
+
+    BufferPool() = default;
+
+    BufferPool(const BufferPool&) = delete;
+
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    /**
+     * Take a buffer, the largest one is preferred
+     * @param size Size of the buffer, the content is unspecified
+     * @return Buffer
+     */
+    Buffer acquire(std::size_t size);
+};
+
+/**
+ * Working memory of a codec, reused for all blocks and calls
+ */
+struct CodecContext {
+    BufferPool buffers;
+    Arena arena;
+};
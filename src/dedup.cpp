@@ -0,0 +1,390 @@
+#include "dedup.h"
+#include "lz77.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <system_error>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void Dedup::open_files_analysis(const std::string& filename) {
+    file_in.open(filename);
+    // Linux:
+    file_out.open("/tmp/" + make_filename_out_analysis(filename, 5));
+}
+
+void Dedup::open_files_decompress(const std::string& filename) {
+    file_in.open(filename);
+    file_out.open(make_filename_out_decompress(filename, 5));
+}
+
+void Dedup::close_files() {
+    file_in.close();
+    file_out.close();
+}
+
+static std::string to_hex(const unsigned char* data, std::size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    std::string res;
+    for (std::size_t i = 0; i < size; i++) {
+        res += digits[data[i] >> 4];
+        res += digits[data[i] & 15];
+    }
+    return res;
+}
+
+/**
+ * Find the end of the chunk which starts at the beginning of the data
+ * The first MIN_CHUNK bytes are skipped, only the last WINDOW of them are added to the hash
+ * @param data Data
+ * @param size Size of the data, at least MAX_CHUNK unless it is the end of the file
+ * @return Length of the chunk
+ */
+std::size_t Dedup::chunk_length(const unsigned char* data, std::size_t size) const {
+    if (size <= MIN_CHUNK) {
+        return size;
+    }
+    std::size_t limit = std::min(size, MAX_CHUNK);
+    std::uint64_t h = 0;
+    std::size_t i = MIN_CHUNK - WINDOW;
+    for (; i < MIN_CHUNK; i++) {
+        h = h * P + data[i] + 1;
+    }
+    for (; i < limit; i++) {
+        h = h * P + data[i] + 1 - out_table[data[i - WINDOW]];
+        if ((h >> (64 - AVERAGE_LOG)) == 0) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+/**
+ * Directory of the cache entries for the current parameters
+ * Chunks compressed with other parameters are kept apart, the name is a hash of the parameters
+ * @return Path of the directory
+ */
+std::string Dedup::cache_path() const {
+    std::vector<unsigned char> bytes;
+    params_to_bytes(params, bytes);
+    unsigned char digest[SHA256::DIGEST_SIZE];
+    SHA256::hash(bytes.data(), bytes.size(), digest);
+    return cache_dir + "/" + to_hex(digest, 8);
+}
+
+/**
+ * Create the directory accessible only to the user, the missing parents are created as usual
+ * @param path Path of the directory
+ * @return False if it can't be created, belongs to another user or can be written by others
+ */
+static bool make_private_dir(const std::string& path) {
+    std::error_code error;
+    std::filesystem::path parent = std::filesystem::path(path).parent_path();
+    if (!parent.empty()) {
+        std::filesystem::create_directories(parent, error);
+    }
+    if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST) {
+        return false;
+    }
+    struct stat info{};
+    return lstat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode) && info.st_uid == geteuid() &&
+           (info.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/**
+ * Cache directory of the user: $XDG_CACHE_HOME/opt_compress or ~/.cache/opt_compress
+ * @return Path of the directory, empty if there is no home directory (the cache is off)
+ */
+std::string Dedup::default_cache_dir() {
+    const char* xdg_cache = std::getenv("XDG_CACHE_HOME");
+    // Relative paths in XDG variables are ignored
+    if (xdg_cache != nullptr && xdg_cache[0] == '/') {
+        return std::string(xdg_cache) + "/opt_compress";
+    }
+    const char* home = std::getenv("HOME");
+    if (home != nullptr && home[0] != '\0') {
+        return std::string(home) + "/.cache/opt_compress";
+    }
+    return "";
+}
+
+/**
+ * Read compressed chunk from the cache and check that it restores the chunk
+ * The key is the hash of the source only, so a damaged or forged entry would otherwise get into the file
+ * @param path Path of the entry
+ * @param chunk Source of the chunk
+ * @param length Length of the chunk
+ * @param lz77 Codec of the chunks
+ * @param compressed Result
+ * @return False if there is no such entry or it is damaged
+ */
+bool Dedup::load_chunk(const std::string& path, const unsigned char* chunk, std::size_t length, LZ77& lz77,
+                       std::vector<unsigned char>& compressed) {
+    bool complete;
+    try {
+        cache_in.open(path);
+        compressed.resize(cache_in.size());
+        complete = cache_in.read((char*)compressed.data(), compressed.size()) == compressed.size();
+        cache_in.close();
+    }
+    catch (const std::system_error&) {
+        return false;
+    }
+    if (!complete || compressed.empty()) {
+        return false;
+    }
+
+    auto restored_buffer = context.buffers.acquire(0);
+    std::vector<unsigned char>& restored = *restored_buffer;
+    const unsigned char* in = compressed.data();
+    const unsigned char* end = in + compressed.size();
+    try {
+        if (!lz77.decode_buffer(in, end, restored) || in != end || restored.size() != length ||
+            std::memcmp(restored.data(), chunk, length) != 0) {
+            return false;
+        }
+    }
+    catch (const std::runtime_error&) {
+        return false;
+    }
+    // Modification time is the time of the last use for the eviction
+    std::error_code error;
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+    return true;
+}
+
+/**
+ * Write compressed chunk to the cache, the entry appears only when it is complete
+ * The cache is optional: if it cannot be written, the chunk is just not cached
+ * @param path Path of the entry
+ * @param compressed Compressed chunk
+ */
+void Dedup::store_chunk(const std::string& path, const std::vector<unsigned char>& compressed) {
+    std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    std::error_code error;
+    try {
+        cache_out.open(tmp_path);
+        cache_out.write((const char*)compressed.data(), compressed.size());
+        cache_out.close();
+    }
+    catch (const std::system_error&) {
+        std::filesystem::remove(tmp_path, error);
+        return;
+    }
+    std::filesystem::rename(tmp_path, path, error);
+    if (error) {
+        std::filesystem::remove(tmp_path, error);
+    }
+}
+
+/**
+ * Remove the least recently used entries while the cache is larger than the limit
+ * Entries of all parameters count, so the limit holds for the whole cache directory
+ */
+void Dedup::evict() {
+    struct Entry {
+        std::filesystem::file_time_type time;
+        std::uint64_t size;
+        std::filesystem::path path;
+    };
+    std::vector<Entry> entries;
+    std::uint64_t total = 0;
+    std::error_code error;
+    std::filesystem::recursive_directory_iterator it(cache_dir, error);
+    for (; !error && it != std::filesystem::recursive_directory_iterator(); it.increment(error)) {
+        std::error_code entry_error;
+        if (!it->is_regular_file(entry_error)) {
+            continue;
+        }
+        std::uint64_t size = it->file_size(entry_error);
+        std::filesystem::file_time_type time = it->last_write_time(entry_error);
+        if (!entry_error) {
+            entries.push_back({time, size, it->path()});
+            total += size;
+        }
+    }
+    if (total <= cache_limit) {
+        return;
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.time < b.time;
+    });
+    for (const Entry& entry : entries) {
+        if (total <= cache_limit) {
+            break;
+        }
+        if (std::filesystem::remove(entry.path, error)) {
+            total -= entry.size;
+        }
+    }
+}
+
+Dedup::Dedup(int level, std::string cache_dir_): Dedup(CodecParams::from_level(level), std::move(cache_dir_)) {}
+
+Dedup::Dedup(const CodecParams& params_, std::string cache_dir_):
+        params(params_), cache_dir(std::move(cache_dir_)), cache_limit(DEFAULT_CACHE_LIMIT), cache_hits(0), cache_misses(0) {
+    std::uint64_t power = 1;
+    for (std::size_t i = 0; i < WINDOW; i++) {
+        power *= P;
+    }
+    for (int b = 0; b < 256; b++) {
+        out_table[b] = (std::uint64_t)(b + 1) * power;
+    }
+}
+
+/**
+ * Set the maximal total size of the cache entries
+ * @param bytes Limit, 0 - entries are not kept
+ */
+void Dedup::set_cache_limit(std::uint64_t bytes) {
+    cache_limit = bytes;
+}
+
+/**
+ * Split the file into chunks and compress the ones which are not in the cache
+ * The file starts with the parameters, then the manifest: for each chunk in order
+ * varint size, SHA-256 of the chunk, varint size of the compressed chunk and the chunk in LZ77 buffer format.
+ * Size 0 ends the manifest and is followed by the checksum of the whole source
+ * @param filename Name of the file
+ */
+void Dedup::encode(const std::string& filename) {
+    open_files_analysis(filename);
+    write_params(file_out, params);
+    std::string entry_dir = cache_path();
+    // The cache is optional: without a private directory the chunks are just compressed
+    bool cached = !cache_dir.empty() && cache_limit > 0 && make_private_dir(cache_dir) && make_private_dir(entry_dir);
+
+    LZ77 lz77(params);
+    Checksum stream_checksum(params.checksum);
+    auto data_buffer = context.buffers.acquire(2 * MAX_CHUNK);
+    auto compressed_buffer = context.buffers.acquire(0);
+    std::vector<unsigned char>& data = *data_buffer;
+    std::vector<unsigned char>& compressed = *compressed_buffer;
+    unsigned char digest[SHA256::DIGEST_SIZE];
+    std::size_t begin = 0;
+    std::size_t end = 0;
+    bool eof = false;
+    cache_hits = 0;
+    cache_misses = 0;
+    while (true) {
+        // Keep at least MAX_CHUNK bytes ahead, so the boundary doesn't depend on the buffer
+        if (end - begin < MAX_CHUNK && !eof) {
+            std::memmove(data.data(), data.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+            std::size_t requested = data.size() - end;
+            std::size_t received = file_in.read((char*)data.data() + end, requested);
+            end += received;
+            eof = received < requested;
+        }
+        if (begin == end) {
+            break;
+        }
+        std::size_t length = chunk_length(data.data() + begin, end - begin);
+        stream_checksum.update(data.data() + begin, length);
+        SHA256::hash(data.data() + begin, length, digest);
+        std::string path = entry_dir + "/" + to_hex(digest, sizeof(digest));
+        compressed.clear();
+        if (cached && load_chunk(path, data.data() + begin, length, lz77, compressed)) {
+            cache_hits++;
+        }
+        else {
+            compressed.clear();
+            lz77.encode_buffer(data.data() + begin, length, compressed);
+            if (cached) {
+                store_chunk(path, compressed);
+            }
+            cache_misses++;
+        }
+
+        write_varint(file_out, length);
+        file_out.write((char*)digest, sizeof(digest));
+        write_varint(file_out, compressed.size());
+        file_out.write((char*)compressed.data(), compressed.size());
+        begin += length;
+    }
+    write_varint(file_out, 0);
+    stream_checksum.write(file_out);
+    close_files();
+    if (cached && cache_misses > 0) {
+        evict();
+    }
+}
+
+/**
+ * Restore the opened file from the manifest, the result is written to file_out if it is open
+ * Every chunk is checked with its SHA-256
+ */
+void Dedup::decode_stream() {
+    CodecParams file_params;
+    if (!read_params(file_in, file_params)) {
+        throw std::runtime_error("Dedup: invalid header");
+    }
+    ScopedParams scoped_params(params, file_params);
+    LZ77 lz77(params);
+    Checksum stream_checksum(params.checksum);
+    auto compressed_buffer = context.buffers.acquire(0);
+    auto chunk_buffer = context.buffers.acquire(0);
+    std::vector<unsigned char>& compressed = *compressed_buffer;
+    std::vector<unsigned char>& chunk = *chunk_buffer;
+    unsigned char expected[SHA256::DIGEST_SIZE];
+    unsigned char digest[SHA256::DIGEST_SIZE];
+    std::uint64_t length;
+    std::uint64_t compressed_size;
+    while (true) {
+        if (!read_varint(file_in, length)) {
+            throw std::runtime_error("Dedup: truncated file");
+        }
+        if (length == 0) {
+            break;
+        }
+        if (length > MAX_CHUNK || file_in.read((char*)expected, sizeof(expected)) != sizeof(expected) ||
+            !read_varint(file_in, compressed_size) || compressed_size > 8 * MAX_CHUNK + 4096) {
+            throw std::runtime_error("Dedup: corrupted manifest");
+        }
+        compressed.resize(compressed_size);
+        if (file_in.read((char*)compressed.data(), compressed_size) != compressed_size) {
+            throw std::runtime_error("Dedup: truncated chunk");
+        }
+        const unsigned char* in = compressed.data();
+        const unsigned char* in_end = in + compressed_size;
+        chunk.clear();
+        if (!lz77.decode_buffer(in, in_end, chunk) || in != in_end || chunk.size() != length) {
+            throw std::runtime_error("Dedup: corrupted chunk");
+        }
+        SHA256::hash(chunk.data(), chunk.size(), digest);
+        if (std::memcmp(digest, expected, sizeof(digest)) != 0) {
+            throw std::runtime_error("Dedup: chunk checksum mismatch");
+        }
+        stream_checksum.update(chunk.data(), chunk.size());
+        file_out.write((char*)chunk.data(), chunk.size());
+    }
+    if (!stream_checksum.check(file_in)) {
+        throw std::runtime_error("Dedup: checksum mismatch");
+    }
+}
+
+/**
+ * Restore the file from the manifest, the cache is not needed
+ * @param filename Name of the file
+ */
+void Dedup::decode(const std::string& filename) {
+    open_files_decompress(filename);
+    decode_stream();
+    close_files();
+}
+
+/**
+ * Decode the file without writing the result
+ * @param filename Name of the file
+ */
+void Dedup::verify(const std::string& filename) {
+    file_in.open(filename);
+    decode_stream();
+    file_in.close();
+}
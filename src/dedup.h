@@ -0,0 +1,133 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "async_io.h"
+#include "checksum.h"
+#include "params.h"
+#include "context.h"
+
+class LZ77;
+
+/**
+ * Content-defined chunking with a cache of compressed chunks shared between runs
+ * Chunk boundaries depend only on the nearby bytes, so an unchanged part of the file gives the same chunks,
+ * and their compressed form (LZ77) is taken from the cache instead of being compressed again
+ */
+class Dedup {
+private:
+    // Rolling hash is a polynomial hash of the last WINDOW bytes
+    static constexpr std::size_t WINDOW = 64;
+    static constexpr std::uint64_t P = 0x9e3779b97f4a7c15ull;
+    // Boundary is where the top AVERAGE_LOG bits of the hash are zero
+    static constexpr unsigned AVERAGE_LOG = 16;
+    static constexpr std::size_t MIN_CHUNK = 1 << 14;
+    static constexpr std::size_t MAX_CHUNK = 1 << 18;
+
+    // Compression parameters of the chunks
+    CodecParams params;
+    // Cache entries are files named by SHA-256 of the chunk in a subdirectory of the parameters
+    std::string cache_dir;
+    // Total size of the entries, the least recently used ones are removed above it
+    std::uint64_t cache_limit;
+
+    AsyncReader file_in;
+    AsyncWriter file_out;
+    AsyncReader cache_in;
+    AsyncWriter cache_out;
+    // Window of the source and the compressed chunks
+    CodecContext context;
+
+    // Contribution of the byte leaving the window: (byte + 1) * P ^ WINDOW
+    std::uint64_t out_table[256];
+
+    void open_files_analysis(const std::string& filename);
+
+    void open_files_decompress(const std::string& filename);
+
+    void close_files();
+
+    /**
+     * Find the end of the chunk which starts at the beginning of the data
+     * @param data Data
+     * @param size Size of the data, at least MAX_CHUNK unless it is the end of the file
+     * @return Length of the chunk
+     */
+    std::size_t chunk_length(const unsigned char* data, std::size_t size) const;
+
+    /**
+     * Directory of the cache entries for the current parameters
+     * @return Path of the directory
+     */
+    std::string cache_path() const;
+
+    /**
+     * Read compressed chunk from the cache and check that it restores the chunk
+     * @param path Path of the entry
+     * @param chunk Source of the chunk
+     * @param length Length of the chunk
+     * @param lz77 Codec of the chunks
+     * @param compressed Result
+     * @return False if there is no such entry or it is damaged
+     */
+    bool load_chunk(const std::string& path, const unsigned char* chunk, std::size_t length, LZ77& lz77,
+                    std::vector<unsigned char>& compressed);
+
+    /**
+     * Write compressed chunk to the cache, the entry appears only when it is complete
+     * @param path Path of the entry
+     * @param compressed Compressed chunk
+     */
+    void store_chunk(const std::string& path, const std::vector<unsigned char>& compressed);
+
+    /**
+     * Remove the least recently used entries while the cache is larger than the limit
+     */
+    void evict();
+
+    /**
+     * Restore the opened file from the manifest, the result is written to file_out if it is open
+     */
+    void decode_stream();
+
+public:
+    static constexpr std::uint64_t DEFAULT_CACHE_LIMIT = (std::uint64_t)1 << 30;
+
+    // Chunks taken from the cache and compressed by the last encode
+    std::uint64_t cache_hits;
+    std::uint64_t cache_misses;
+
+    /**
+     * Cache directory of the user: $XDG_CACHE_HOME/opt_compress or ~/.cache/opt_compress
+     * @return Path of the directory, empty if there is no home directory (the cache is off)
+     */
+    static std::string default_cache_dir();
+
+    explicit Dedup(int level = CodecParams::DEFAULT_LEVEL, std::string cache_dir_ = default_cache_dir());
+
+    explicit Dedup(const CodecParams& params_, std::string cache_dir_ = default_cache_dir());
+
+    /**
+     * Set the maximal total size of the cache entries
+     * @param bytes Limit, 0 - entries are not kept
+     */
+    void set_cache_limit(std::uint64_t bytes);
+
+    /**
+     * Split the file into chunks and compress the ones which are not in the cache
+     * @param filename Name of the file
+     */
+    void encode(const std::string& filename);
+
+    /**
+     * Restore the file from the manifest, the cache is not needed
+     * @param filename Name of the file
+     */
+    void decode(const std::string& filename);
+
+    /**
+     * Decode the file without writing the result, throws std::runtime_error if it is damaged
+     * @param filename Name of the file
+     */
+    void verify(const std::string& filename);
+};
@@ -0,0 +1,289 @@
+#include "filter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+// detect_stride looks only at the beginning of the block
+static const std::size_t SAMPLE_SIZE = 1 << 16;
+
+/**
+ * Size of the data in bits with order-0 coding, including the cost of the table
+ * @param counts Counts of 256 symbols
+ * @param total Sum of the counts
+ * @return Size in bits
+ */
+static double coded_bits(const std::uint32_t* counts, std::size_t total) {
+    double bits = 0;
+    for (int c = 0; c < 256; c++) {
+        if (counts[c] > 0) {
+            bits += counts[c] * std::log2((double)total / counts[c]) + 8;
+        }
+    }
+    return bits;
+}
+
+/**
+ * Find the record size for which the filter gives the lowest order-0 entropy, on a sample of the block
+ * Every plane (byte of the record) has its own statistics for Split, so the entropy is summed over planes.
+ * A stride is chosen only if it saves at least 3% against the unfiltered sample
+ * @param kind Filter
+ * @param data Block
+ * @param size Size of the block
+ * @return Stride from 1 to MAX_FILTER_STRIDE, 0 if the block is better left as it is
+ */
+unsigned detect_stride(FilterKind kind, const unsigned char* data, std::size_t size) {
+    if (kind == FilterKind::None) {
+        return 0;
+    }
+    const bool delta = kind == FilterKind::Delta || kind == FilterKind::DeltaSplit;
+    const bool split = kind == FilterKind::Split || kind == FilterKind::DeltaSplit;
+    std::size_t n = std::min(size, SAMPLE_SIZE);
+    std::uint32_t counts[MAX_FILTER_STRIDE][256];
+
+    std::fill(counts[0], counts[0] + 256, 0);
+    for (std::size_t i = 0; i < n; i++) {
+        counts[0][data[i]]++;
+    }
+    double best_bits = 0.97 * coded_bits(counts[0], n);
+    unsigned best_stride = 0;
+
+    for (unsigned stride = 1; stride <= MAX_FILTER_STRIDE && stride < n; stride++) {
+        unsigned planes = split ? stride : 1;
+        for (unsigned j = 0; j < planes; j++) {
+            std::fill(counts[j], counts[j] + 256, 0);
+        }
+        unsigned plane = 0;
+        for (std::size_t i = 0; i < n; i++) {
+            auto value = (unsigned char)(delta && i >= stride ? data[i] - data[i - stride] : data[i]);
+            counts[plane][value]++;
+            if (split && ++plane == stride) {
+                plane = 0;
+            }
+        }
+        double bits = 0;
+        for (unsigned j = 0; j < planes; j++) {
+            bits += coded_bits(counts[j], n / planes);
+        }
+        if (bits < best_bits) {
+            best_bits = bits;
+            best_stride = stride;
+        }
+    }
+    return best_stride;
+}
+
+static void delta_forward(unsigned stride, const unsigned char* src, std::size_t size, unsigned char* dst) {
+    std::size_t head = std::min<std::size_t>(stride, size);
+    std::memcpy(dst, src, head);
+    // No dependency between iterations, the loop is vectorized by the compiler
+    for (std::size_t i = head; i < size; i++) {
+        dst[i] = (unsigned char)(src[i] - src[i - stride]);
+    }
+}
+
+/**
+ * Inverse delta, S = 0 means that the stride is not known at compile time
+ * With a constant stride of at least 16 bytes the loop is vectorized by the compiler
+ */
+template <unsigned S>
+static void delta_inverse_scalar(unsigned stride, const unsigned char* src, std::size_t size, unsigned char* dst) {
+    const std::size_t s = S != 0 ? S : stride;
+    std::size_t head = std::min(s, size);
+    std::memcpy(dst, src, head);
+    for (std::size_t i = head; i < size; i++) {
+        dst[i] = (unsigned char)(src[i] + dst[i - s]);
+    }
+}
+
+#if defined(__x86_64__)
+/**
+ * Last record of the vector repeated over the whole vector
+ */
+template <int S>
+static inline __m128i broadcast_last(__m128i v) {
+    if constexpr (S == 1) {
+        __m128i x = _mm_srli_si128(v, 15);
+        x = _mm_unpacklo_epi8(x, x);
+        x = _mm_unpacklo_epi16(x, x);
+        return _mm_shuffle_epi32(x, 0);
+    }
+    else if constexpr (S == 2) {
+        __m128i x = _mm_srli_si128(v, 14);
+        x = _mm_shufflelo_epi16(x, 0);
+        return _mm_shuffle_epi32(x, 0);
+    }
+    else if constexpr (S == 4) {
+        return _mm_shuffle_epi32(v, 0xFF);
+    }
+    else {
+        return _mm_shuffle_epi32(v, 0xEE);
+    }
+}
+
+/**
+ * Inverse delta for strides which divide 16 with SSE2
+ * Prefix sums with step S are made inside the vector by shifts (log(16 / S) additions),
+ * then the last record of the previous vector is added to every record
+ */
+template <int S>
+static void delta_inverse_sse2(const unsigned char* src, std::size_t size, unsigned char* dst) {
+    __m128i carry = _mm_setzero_si128();
+    std::size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+        v = _mm_add_epi8(v, _mm_slli_si128(v, S));
+        if constexpr (S <= 4) {
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 2 * S));
+        }
+        if constexpr (S <= 2) {
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 4 * S));
+        }
+        if constexpr (S == 1) {
+            v = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+        }
+        v = _mm_add_epi8(v, carry);
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+        carry = broadcast_last<S>(v);
+    }
+    for (; i < size; i++) {
+        dst[i] = (unsigned char)(src[i] + (i >= S ? dst[i - S] : 0));
+    }
+}
+#endif
+
+static void delta_inverse(unsigned stride, const unsigned char* src, std::size_t size, unsigned char* dst) {
+    switch (stride) {
+#if defined(__x86_64__)
+        case 1:
+            delta_inverse_sse2<1>(src, size, dst);
+            return;
+        case 2:
+            delta_inverse_sse2<2>(src, size, dst);
+            return;
+        case 4:
+            delta_inverse_sse2<4>(src, size, dst);
+            return;
+        case 8:
+            delta_inverse_sse2<8>(src, size, dst);
+            return;
+#endif
+        case 16:
+            delta_inverse_scalar<16>(stride, src, size, dst);
+            return;
+        default:
+            delta_inverse_scalar<0>(stride, src, size, dst);
+    }
+}
+
+/**
+ * Byte planes: plane j holds byte j of every record (or its difference with the previous record),
+ * the bytes after the last whole record are copied as they are.
+ * A constant stride lets the compiler vectorize the strided loads
+ */
+template <bool DELTA, unsigned S>
+static void split_forward(unsigned stride, const unsigned char* src, std::size_t size, unsigned char* dst) {
+    const std::size_t s = S != 0 ? S : stride;
+    std::size_t rows = size / s;
+    for (std::size_t j = 0; j < s && rows > 0; j++) {
+        const unsigned char* column = src + j;
+        unsigned char* plane = dst + j * rows;
+        plane[0] = column[0];
+        for (std::size_t r = 1; r < rows; r++) {
+            plane[r] = DELTA ? (unsigned char)(column[r * s] - column[(r - 1) * s]) : column[r * s];
+        }
+    }
+    std::memcpy(dst + rows * s, src + rows * s, size - rows * s);
+}
+
+template <bool DELTA, unsigned S>
+static void split_inverse(unsigned stride, const unsigned char* src, std::size_t size, unsigned char* dst) {
+    const std::size_t s = S != 0 ? S : stride;
+    std::size_t rows = size / s;
+    for (std::size_t j = 0; j < s && rows > 0; j++) {
+        const unsigned char* plane = src + j * rows;
+        unsigned char* column = dst + j;
+        unsigned char value = 0;
+        for (std::size_t r = 0; r < rows; r++) {
+            value = DELTA ? (unsigned char)(value + plane[r]) : plane[r];
+            column[r * s] = value;
+        }
+    }
+    std::memcpy(dst + rows * s, src + rows * s, size - rows * s);
+}
+
+template <bool DELTA>
+static void split_dispatch(bool forward, unsigned stride, const unsigned char* src, std::size_t size, unsigned char* dst) {
+    auto run = [&]<unsigned S>() {
+        if (forward) {
+            split_forward<DELTA, S>(stride, src, size, dst);
+        }
+        else {
+            split_inverse<DELTA, S>(stride, src, size, dst);
+        }
+    };
+    switch (stride) {
+        case 2:
+            run.template operator()<2>();
+            return;
+        case 4:
+            run.template operator()<4>();
+            return;
+        case 8:
+            run.template operator()<8>();
+            return;
+        default:
+            run.template operator()<0>();
+    }
+}
+
+/**
+ * Apply the filter
+ * @param kind Filter
+ * @param stride Size of a record, from 1 to MAX_FILTER_STRIDE
+ * @param src Block
+ * @param size Size of the block
+ * @param dst Result, size bytes, doesn't overlap the block
+ */
+void filter_forward(FilterKind kind, unsigned stride, const unsigned char* src, std::size_t size, unsigned char* dst) {
+    switch (kind) {
+        case FilterKind::Delta:
+            delta_forward(stride, src, size, dst);
+            return;
+        case FilterKind::Split:
+            split_dispatch<false>(true, stride, src, size, dst);
+            return;
+        case FilterKind::DeltaSplit:
+            split_dispatch<true>(true, stride, src, size, dst);
+            return;
+        default:
+            std::memcpy(dst, src, size);
+    }
+}
+
+/**
+ * Undo the filter
+ * @param kind Filter
+ * @param stride Size of a record, from 1 to MAX_FILTER_STRIDE
+ * @param src Filtered block
+ * @param size Size of the block
+ * @param dst Result, size bytes, doesn't overlap the filtered block
+ */
+void filter_inverse(FilterKind kind, unsigned stride, const unsigned char* src, std::size_t size, unsigned char* dst) {
+    switch (kind) {
+        case FilterKind::Delta:
+            delta_inverse(stride, src, size, dst);
+            return;
+        case FilterKind::Split:
+            split_dispatch<false>(false, stride, src, size, dst);
+            return;
+        case FilterKind::DeltaSplit:
+            split_dispatch<true>(false, stride, src, size, dst);
+            return;
+        default:
+            std::memcpy(dst, src, size);
+    }
+}
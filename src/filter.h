@@ -0,0 +1,46 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Reversible filter applied to every block before the codec
+ * The data is seen as records of stride bytes: Delta subtracts the byte of the previous record,
+ * Split puts byte j of all records into plane j, DeltaSplit makes the planes of the differences
+ */
+enum class FilterKind : unsigned {
+    None = 0,
+    Delta = 1,
+    Split = 2,
+    DeltaSplit = 3
+};
+
+const unsigned MAX_FILTER_STRIDE = 16;
+
+/**
+ * Find the record size for which the filter gives the lowest order-0 entropy, on a sample of the block
+ * @param kind Filter
+ * @param data Block
+ * @param size Size of the block
+ * @return Stride from 1 to MAX_FILTER_STRIDE, 0 if the block is better left as it is
+ */
+unsigned detect_stride(FilterKind kind, const unsigned char* data, std::size_t size);
+
+/**
+ * Apply the filter
+ * @param kind Filter
+ * @param stride Size of a record, from 1 to MAX_FILTER_STRIDE
+ * @param src Block
+ * @param size Size of the block
+ * @param dst Result, size bytes, doesn't overlap the block
+ */
+void filter_forward(FilterKind kind, unsigned stride, const unsigned char* src, std::size_t size, unsigned char* dst);
+
+/**
+ * Undo the filter
+ * @param kind Filter
+ * @param stride Size of a record, from 1 to MAX_FILTER_STRIDE
+ * @param src Filtered block
+ * @param size Size of the block
+ * @param dst Result, size bytes, doesn't overlap the filtered block
+ */
+void filter_inverse(FilterKind kind, unsigned stride, const unsigned char* src, std::size_t size, unsigned char* dst);
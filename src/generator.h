@@ -0,0 +1,133 @@
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <utility>
+
+/**
+ * Lazy sequence produced by a coroutine with co_yield
+ * The coroutine runs only when the next value is requested, a yielded value is valid until the next request
+ */
+template <typename T>
+class Generator {
+public:
+    struct promise_type {
+        const T* value = nullptr;
+        std::exception_ptr exception;
+
+        Generator get_return_object() {
+            return Generator(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+
+        // The yielded object lives in the coroutine until it is resumed
+        std::suspend_always yield_value(const T& yielded) noexcept {
+            value = std::addressof(yielded);
+            return {};
+        }
+
+        void return_void() noexcept {}
+
+        void unhandled_exception() {
+            exception = std::current_exception();
+        }
+    };
+
+    using Handle = std::coroutine_handle<promise_type>;
+
+    class iterator {
+    private:
+        Generator* generator;
+
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+
+        explicit iterator(Generator* generator_ = nullptr): generator(generator_) {}
+
+        const T& operator*() const {
+            return generator->value();
+        }
+
+        iterator& operator++() {
+            if (!generator->next()) {
+                generator = nullptr;
+            }
+            return *this;
+        }
+
+        bool operator==(const iterator& other) const {
+            return generator == other.generator;
+        }
+    };
+
+    Generator(Generator&& other) noexcept: handle(std::exchange(other.handle, nullptr)) {}
+
+    Generator& operator=(Generator&& other) noexcept {
+        if (this != &other) {
+            destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    Generator(const Generator&) = delete;
+
+    Generator& operator=(const Generator&) = delete;
+
+    ~Generator() {
+        destroy();
+    }
+
+    /**
+     * Run the coroutine up to the next value
+     * Exceptions of the coroutine are thrown here
+     * @return False if the coroutine has finished
+     */
+    bool next() {
+        if (!handle || handle.done()) {
+            return false;
+        }
+        handle.resume();
+        if (handle.promise().exception) {
+            std::rethrow_exception(std::exchange(handle.promise().exception, nullptr));
+        }
+        return !handle.done();
+    }
+
+    /**
+     * Last value returned by next()
+     */
+    const T& value() const {
+        return *handle.promise().value;
+    }
+
+    iterator begin() {
+        return iterator(next() ? this : nullptr);
+    }
+
+    iterator end() {
+        return iterator();
+    }
+
+private:
+    Handle handle;
+
+    explicit Generator(Handle handle_): handle(handle_) {}
+
+    void destroy() {
+        if (handle) {
+            handle.destroy();
+            handle = nullptr;
+        }
+    }
+};
@@ -1,5 +1,9 @@
 #include "huffman.h"
 
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+
 HNode::HNode() {
     contains = false;
     l = nullptr;
@@ -7,7 +11,7 @@ HNode::HNode() {
     priority = 0;
 }
 
-HNode::HNode(unsigned char ubyte, unsigned int freq) {
+HNode::HNode(unsigned char ubyte, std::uint64_t freq) {
     contains = true;
     symbol = ubyte;
     l = nullptr;
@@ -22,29 +26,16 @@ HNode::HNode(HNode* nl, HNode* nr) {
     priority = nl->priority + nr->priority;
 }
 
-/**
- * Delete Huffman tree before each run of the algorithm
- * @param v Huffman tree vertex
- */
-void Huffman::delete_tree(HNode* v) {
-    if (v == nullptr) {
-        return;
-    }
-    delete_tree(v->l);
-    delete_tree(v->r);
-    delete v;
-}
-
 void Huffman::open_files_analysis(const std::string& filename) {
     file_in.open(filename);
     // Linux:
-    file_out.open("/tmp/" + make_filename_out_analysis(filename, 2), std::ios::binary | std::ios::out | std::ios::app);
+    file_out.open("/tmp/" + make_filename_out_analysis(filename, 2));
 
 };
 
 void Huffman::open_files_decompress(const std::string& filename) {
     file_in.open(filename);
-    file_out.open(make_filename_out_decompress(filename, 2), std::ios::binary | std::ios::out | std::ios::app);
+    file_out.open(make_filename_out_decompress(filename, 2));
 };
 
 void Huffman::close_files() {
@@ -54,44 +45,59 @@ void Huffman::close_files() {
 
 /**
  * Read file and find frequency for each symbol
+ * @param stream_checksum Checksum of the file is counted in the same pass
  */
-void Huffman::make_freq_table() {
+void Huffman::make_freq_table(Checksum& stream_checksum) {
     std::fill(freq_table, freq_table + 256, 0);
-    char byte;
-    unsigned char ubyte;
-    while (file_in.get(byte)) {
-        ubyte = (unsigned char) byte;
-        freq_table[ubyte]++;
+    auto data = context.buffers.acquire(OUT_BUFFER_SIZE);
+    std::size_t data_size;
+    while ((data_size = file_in.read((char*)data->data(), data->size())) > 0) {
+        stream_checksum.update(data->data(), data_size);
+        for (std::size_t i = 0; i < data_size; i++) {
+            freq_table[(*data)[i]]++;
+        }
     }
-    file_in.clear();
-    file_in.seekg(0);
+    file_in.rewind();
 }
 
 /**
  * Build Huffman tree
+ * Nodes are allocated in the arena, the priority queue is a heap over the reused vector
  * @return Root of Huffman tree
  */
 HNode* Huffman::make_tree() {
     auto comparator = [](HNode* a, HNode* b) {return a->priority > b->priority;};
-    std::priority_queue<HNode*, std::vector<HNode*>, decltype(comparator)> queue(comparator);
-
+    auto push = [&](HNode* node) {
+        heap.push_back(node);
+        std::push_heap(heap.begin(), heap.end(), comparator);
+    };
+    auto pop = [&]() {
+        std::pop_heap(heap.begin(), heap.end(), comparator);
+        HNode* node = heap.back();
+        heap.pop_back();
+        return node;
+    };
+
+    heap.clear();
     for (int i = 0; i < 256; i++) {
         if (freq_table[i] > 0) {
-            auto new_node = new HNode((unsigned char)i, freq_table[i]);
-            queue.push(new_node);
+            push(context.arena.make<HNode>((unsigned char)i, freq_table[i]));
         }
     }
-    while (queue.size() > 1) {
-        HNode* t1 = queue.top();
-        queue.pop();
-        HNode* t2 = queue.top();
-        queue.pop();
-        auto merged = new HNode(t1, t2);
-        queue.push(merged);
+    if (heap.empty()) {
+        return nullptr;
+    }
+    // A single symbol still needs a code of length 1
+    if (heap.size() == 1) {
+        push(context.arena.make<HNode>());
+    }
+    while (heap.size() > 1) {
+        HNode* t1 = pop();
+        HNode* t2 = pop();
+        push(context.arena.make<HNode>(t1, t2));
     }
 
-    HNode* root = queue.top();
-    return root;
+    return heap.front();
 }
 
 /**
@@ -100,13 +106,16 @@ HNode* Huffman::make_tree() {
  * @param code Current code
  * @param length Length of the current code
  */
-void Huffman::make_codes(HNode* node, int code, int length) {
+void Huffman::make_codes(HNode* node, std::uint64_t code, int length) {
+    if (node == nullptr) {
+        return;
+    }
     if (node->contains) {
         codes[node->symbol] = {length, code};
         return;
     }
     make_codes(node->l, code, length + 1);
-    make_codes(node->r, code | (1 << length), length + 1);
+    make_codes(node->r, code | ((std::uint64_t)1 << length), length + 1);
 }
 
 /**
@@ -123,7 +132,46 @@ void Huffman::go_tree(HNode*& node, bool move) {
     }
 }
 
-Huffman::Huffman(): tree_root(nullptr){};
+/**
+ * Build Huffman tree and codes for the current frequency table
+ * If the codes are too long, frequencies are halved until they fit (the table is changed)
+ * @param max_length Maximal length of a code
+ */
+void Huffman::build_codes(unsigned max_length) {
+    while (true) {
+        // The previous tree is released with the arena
+        context.arena.reset();
+        tree_root = make_tree();
+        std::fill(codes, codes + 256, std::make_pair(0, 0));
+        make_codes(tree_root, 0, 0);
+
+        int longest = 0;
+        for (const auto& code : codes) {
+            longest = std::max(longest, code.first);
+        }
+        if (longest <= (int)max_length) {
+            return;
+        }
+        for (std::uint64_t& freq : freq_table) {
+            if (freq > 0) {
+                freq = (freq + 1) / 2;
+            }
+        }
+    }
+}
+
+Huffman::Huffman(int level): Huffman(CodecParams::from_level(level)) {}
+
+/**
+ * The file is coded as one stream without blocks, so the filters are not supported
+ * @param params_ Parameters, throws std::invalid_argument if the filter is on
+ */
+Huffman::Huffman(const CodecParams& params_): params(params_), tree_root(nullptr), table_count(0) {
+    if (params.filter != FilterKind::None) {
+        throw std::invalid_argument("Huffman: filters are not supported");
+    }
+    heap.reserve(257);
+}
 
 /**
  * Huffman encoding
@@ -131,156 +179,682 @@ Huffman::Huffman(): tree_root(nullptr){};
  */
 void Huffman::encode(const std::string& filename) {
     open_files_analysis(filename);
-    make_freq_table();
-    if (tree_root != nullptr) {
-        delete_tree(tree_root);
+    write_params(file_out, params);
+    if (params.huffman_tables > 1) {
+        encode_contexts();
+        close_files();
+        return;
+    }
+    Checksum stream_checksum(params.checksum);
+    make_freq_table(stream_checksum);
+    std::uint64_t counts[256];
+    std::copy(freq_table, freq_table + 256, counts);
+    build_codes(params.max_code_length);
+
+    // Number of bytes in compressed file (there can be a zero byte in the end of the file)
+    std::uint64_t cnt_bits = 0;
+    for (int i = 0; i < 256; i++) {
+        cnt_bits += counts[i] * codes[i].first;
+    }
+    std::uint64_t cnt_bytes = cnt_bits / 8 + 1;
+    auto length_last = (unsigned char)(cnt_bits % 8);
+
+    // begin of the file - frequencies of bytes (varint for each byte)
+    for (std::uint64_t i : freq_table) {
+        write_varint(file_out, i);
     }
-    tree_root = make_tree();
-    std::fill(codes, codes + 256, std::make_pair(0, 0));
-    make_codes(tree_root, 0, 0);
+    write_varint(file_out, cnt_bytes);
+    file_out.put((char)length_last);
 
     char byte;
     unsigned char ubyte;
     unsigned char write_byte = 0;
     unsigned char pos = 0;
-    unsigned int cnt_bytes = 0;
-
-    // first element of encoded is length of the last byte
-    std::vector<unsigned char> encoded;
     while(file_in.get(byte)) {
         ubyte = (unsigned char)byte;
-        int code = codes[ubyte].second;
+        std::uint64_t code = codes[ubyte].second;
         int length = codes[ubyte].first;
         for (int j = 0; j < length; j++) {
-            if (code & (1 << j)) {
+            if (code & ((std::uint64_t)1 << j)) {
                 write_byte = write_byte | (1 << pos);
             }
             pos++;
             if (pos == 8) {
-                encoded.push_back(write_byte);
+                file_out.put((char)write_byte);
                 pos = 0;
                 write_byte = 0;
-                cnt_bytes++;
             }
         }
     }
-    cnt_bytes++;
-    encoded.insert(encoded.begin(), pos);
-    encoded.push_back(write_byte);
+    file_out.put((char)write_byte);
+    stream_checksum.write(file_out);
+    close_files();
+}
 
-    std::cout << cnt_bytes << ' ' << encoded.size() << std::endl;
+/**
+ * Decode the opened file, the result is written to file_out if it is open
+ * Every step through the tree is checked, so damaged data can't lead outside of it
+ */
+void Huffman::decode_stream() {
+    CodecParams file_params;
+    if (!read_params(file_in, file_params) || file_params.filter != FilterKind::None) {
+        throw std::runtime_error("Huffman: invalid header");
+    }
+    ScopedParams scoped_params(params, file_params);
+    if (params.huffman_tables > 1) {
+        decode_contexts();
+        return;
+    }
 
-    // begin of the file - frequencies of bytes (unsigned int for each byte)
-    unsigned char k_chars[4];
-    for (unsigned int i : freq_table) {
-        int_to_chars(k_chars, i);
-        for (unsigned char c : k_chars) {
-            file_out.write((char*)&c, sizeof(c));
+    std::fill(freq_table, freq_table + 256, 0);
+    char byte;
+    unsigned char ubyte;
+    for (std::uint64_t& symbol : freq_table) {
+        if (!read_varint(file_in, symbol)) {
+            throw std::runtime_error("Huffman: invalid header");
         }
     }
+    build_codes(64);
 
-    // Number of bytes in compressed file (there can be a zero byte in the end of the file)
-    int_to_chars(k_chars, cnt_bytes);
-    for (unsigned char c : k_chars) {
-        file_out.write((char*)&c, sizeof(c));
+    std::uint64_t cnt_bytes;
+    if (!read_varint(file_in, cnt_bytes) || !file_in.get(byte)) {
+        throw std::runtime_error("Huffman: invalid header");
     }
+    ubyte = (unsigned char)byte;
 
-    for (unsigned char c : encoded) {
-        file_out.write((char*)&c, sizeof(c));
+    unsigned char length_last = ubyte;
+    if (cnt_bytes == 0 || length_last >= 8 || (tree_root == nullptr && (cnt_bytes > 1 || length_last > 0))) {
+        throw std::runtime_error("Huffman: invalid header");
     }
+    HNode* v = tree_root;
 
-    for (unsigned int i : freq_table) {
-        std::cout << i << std::endl;
-    }
+    Checksum stream_checksum(params.checksum);
+    auto out_buffer = context.buffers.acquire(OUT_BUFFER_SIZE);
+    std::vector<unsigned char>& out = *out_buffer;
+    std::size_t out_pos = 0;
+    for (; cnt_bytes > 0; cnt_bytes--) {
+        if (!file_in.get(byte)) {
+            throw std::runtime_error("Huffman: truncated file");
+        }
+        ubyte = (unsigned char)byte;
+        int end = 8;
+        // If it is the last byte
+        if (cnt_bytes == 1) {
+            end = length_last;
+        }
 
-    // printing codes (for testing)
-    for (int i = 0; i < 256; i++) {
-        int length = codes[i].first;
-        int code = codes[i].second;
-        std::cout << freq_table[i] << ' ' << length <<  " ";
-        for (int j = 0; j < length; j++) {
-            if (code & (1 << j)) {
-                std::cout << "1";
+        // Going through the tree
+        for (int i = 0; i < end; i++) {
+            if ((1 << i) & ubyte) {
+                go_tree(v, true);
             }
             else {
-                std::cout << "0";
+                go_tree(v, false);
+            }
+            if (v == nullptr) {
+                throw std::runtime_error("Huffman: corrupted data");
             }
+            if (v->contains) {
+                out[out_pos++] = v->symbol;
+                v = tree_root;
+            }
+        }
+        // One byte gives at most 8 symbols
+        if (out_pos + 8 > out.size()) {
+            stream_checksum.update(out.data(), out_pos);
+            file_out.write((char*)out.data(), out_pos);
+            out_pos = 0;
         }
-        std::cout << std::endl;
     }
+    // The last code must be complete
+    if (v != tree_root) {
+        throw std::runtime_error("Huffman: corrupted data");
+    }
+    stream_checksum.update(out.data(), out_pos);
+    file_out.write((char*)out.data(), out_pos);
+    if (!stream_checksum.check(file_in)) {
+        throw std::runtime_error("Huffman: checksum mismatch");
+    }
+}
 
-    close_files();
+/**
+ * Read file and find frequency for each symbol after each byte, the first symbol follows byte 0
+ * @param stream_checksum Checksum of the file is counted in the same pass
+ */
+void Huffman::make_context_table(Checksum& stream_checksum) {
+    context_freq.assign(256 * 256, 0);
+    auto data = context.buffers.acquire(OUT_BUFFER_SIZE);
+    std::size_t data_size;
+    unsigned char prev = 0;
+    while ((data_size = file_in.read((char*)data->data(), data->size())) > 0) {
+        stream_checksum.update(data->data(), data_size);
+        for (std::size_t i = 0; i < data_size; i++) {
+            unsigned char c = (*data)[i];
+            context_freq[prev * 256 + c]++;
+            prev = c;
+        }
+    }
+    file_in.rewind();
 }
 
 /**
- * Huffman decoding
- * @param filename Name of the file
+ * Code lengths for the current frequency table, at most CONTEXT_CODE_LENGTH
+ * @param lengths Result, 256 lengths
  */
-void Huffman::decode(const std::string& filename) {
-    open_files_decompress(filename);
+void Huffman::build_lengths(unsigned char* lengths) {
+    build_codes(CONTEXT_CODE_LENGTH);
+    for (int i = 0; i < 256; i++) {
+        lengths[i] = (unsigned char)codes[i].first;
+    }
+}
 
-    std::fill(freq_table, freq_table + 256, 0);
-    char byte;
-    unsigned char ubyte;
-    unsigned char k_chars[4];
-    for (unsigned int& symbol : freq_table) {
-        for (unsigned char& k_char : k_chars) {
-            file_in.get(byte);
-            ubyte = (unsigned char)byte;
-            k_char = ubyte;
-        }
-        unsigned int freq = chars_to_int(k_chars);
-        symbol = freq;
+/**
+ * Canonical codes for the code lengths, bit-reversed because the bits are written from the lowest one
+ * Shorter codes go first, codes of the same length are in the order of symbols
+ * @param lengths 256 code lengths
+ * @param codes Result, 256 codes
+ */
+void Huffman::canonical_codes(const unsigned char* lengths, std::uint16_t* codes) {
+    unsigned count[CONTEXT_CODE_LENGTH + 1] = {};
+    for (int i = 0; i < 256; i++) {
+        count[lengths[i]]++;
     }
-    for (unsigned int i : freq_table) {
-        std::cout << i << std::endl;
+    count[0] = 0;
+    unsigned next[CONTEXT_CODE_LENGTH + 1] = {};
+    unsigned code = 0;
+    for (unsigned length = 1; length <= CONTEXT_CODE_LENGTH; length++) {
+        code = (code + count[length - 1]) << 1;
+        next[length] = code;
     }
+    for (int i = 0; i < 256; i++) {
+        unsigned length = lengths[i];
+        if (length == 0) {
+            codes[i] = 0;
+            continue;
+        }
+        unsigned canonical = next[length]++;
+        unsigned reversed = 0;
+        for (unsigned j = 0; j < length; j++) {
+            reversed |= ((canonical >> j) & 1) << (length - 1 - j);
+        }
+        codes[i] = (std::uint16_t)reversed;
+    }
+}
 
-    if (tree_root != nullptr) {
-        delete_tree(tree_root);
+/**
+ * Group contexts into tables and build the code lengths of the tables
+ * Clustering is k-means: the most frequent contexts are the initial tables, then every context moves
+ * to the table which codes it in the fewest bits and the tables are recounted. Empty tables are dropped
+ * @param tables Maximal number of tables
+ * @return Size of the header and the data in bits
+ */
+std::uint64_t Huffman::cluster_contexts(unsigned tables) {
+    std::uint64_t totals[256];
+    int order[256];
+    unsigned used = 0;
+    for (int c = 0; c < 256; c++) {
+        totals[c] = std::accumulate(context_freq.begin() + c * 256, context_freq.begin() + (c + 1) * 256,
+                                    (std::uint64_t)0);
+        used += totals[c] > 0;
+    }
+    std::iota(order, order + 256, 0);
+    std::stable_sort(order, order + 256, [&](int a, int b) {return totals[a] > totals[b];});
+    tables = std::max(1u, std::min(tables, used));
+
+    // Unassigned contexts have table `tables`, the initial tables contain one context each
+    const unsigned unassigned = tables;
+    std::fill(context_map, context_map + 256, (unsigned char)unassigned);
+    for (unsigned j = 0; j < tables; j++) {
+        context_map[order[j]] = (unsigned char)j;
+    }
+    std::vector<std::uint64_t> sums(tables * 256);
+    std::vector<double> cost(tables * 256);
+    for (unsigned iteration = 0; iteration < KMEANS_ITERATIONS; iteration++) {
+        std::fill(sums.begin(), sums.end(), 0);
+        for (int c = 0; c < 256; c++) {
+            if (context_map[c] == unassigned) {
+                continue;
+            }
+            for (int s = 0; s < 256; s++) {
+                sums[context_map[c] * 256 + s] += context_freq[c * 256 + s];
+            }
+        }
+        // Bits for a symbol of the table, unseen symbols get a small probability
+        for (unsigned j = 0; j < tables; j++) {
+            double total = (double)std::accumulate(sums.begin() + j * 256, sums.begin() + (j + 1) * 256,
+                                                   (std::uint64_t)0);
+            for (int s = 0; s < 256; s++) {
+                cost[j * 256 + s] = -std::log2(((double)sums[j * 256 + s] + 0.5) / (total + 128));
+            }
+        }
+        bool changed = false;
+        for (int c = 0; c < 256; c++) {
+            if (totals[c] == 0) {
+                continue;
+            }
+            unsigned best = 0;
+            double best_cost = 0;
+            for (unsigned j = 0; j < tables; j++) {
+                double bits = 0;
+                for (int s = 0; s < 256; s++) {
+                    bits += (double)context_freq[c * 256 + s] * cost[j * 256 + s];
+                }
+                if (j == 0 || bits < best_cost) {
+                    best = j;
+                    best_cost = bits;
+                }
+            }
+            changed |= context_map[c] != best;
+            context_map[c] = (unsigned char)best;
+        }
+        if (!changed) {
+            break;
+        }
     }
 
-    tree_root = make_tree();
-    make_codes(tree_root, 0, 0);
+    // Number the non-empty tables in order, unused contexts go to the first table
+    unsigned char index[MAX_TABLES + 1];
+    std::fill(index, index + MAX_TABLES + 1, (unsigned char)unassigned);
+    table_count = 0;
+    for (unsigned j = 0; j < tables; j++) {
+        for (int c = 0; c < 256; c++) {
+            if (context_map[c] == j && totals[c] > 0) {
+                index[j] = (unsigned char)table_count++;
+                break;
+            }
+        }
+    }
+    table_count = std::max(table_count, 1u);
+    for (int c = 0; c < 256; c++) {
+        context_map[c] = totals[c] > 0 ? index[context_map[c]] : 0;
+    }
 
-    for (unsigned char& k_char : k_chars) {
-        file_in.get(byte);
-        ubyte = (unsigned char)byte;
-        k_char = ubyte;
+    table_lengths.assign(table_count * 256, 0);
+    std::uint64_t bits = 8 * (128 * (std::uint64_t)table_count + (table_count > 1 ? 256 : 0));
+    for (unsigned j = 0; j < table_count; j++) {
+        std::uint64_t counts[256] = {};
+        for (int c = 0; c < 256; c++) {
+            if (context_map[c] == j) {
+                for (int s = 0; s < 256; s++) {
+                    counts[s] += context_freq[c * 256 + s];
+                }
+            }
+        }
+        std::copy(counts, counts + 256, freq_table);
+        unsigned char* lengths = table_lengths.data() + j * 256;
+        build_lengths(lengths);
+        for (int s = 0; s < 256; s++) {
+            bits += counts[s] * lengths[s];
+        }
     }
+    return bits;
+}
 
-    unsigned int cnt_bytes = chars_to_int(k_chars);
-    std::cout << cnt_bytes << std::endl;
-    file_in.get(byte);
-    ubyte = (unsigned char)byte;
+/**
+ * Cluster contexts with the number of tables which gives the smallest result
+ * Numbers of tables are tried from 1 doubling up to params.huffman_tables, more tables cost more header
+ */
+void Huffman::choose_tables() {
+    unsigned max_tables = std::min(params.huffman_tables, MAX_TABLES);
+    unsigned best_tables = 1;
+    std::uint64_t best_bits = UINT64_MAX;
+    for (unsigned tables = 1;; tables = std::min(2 * tables, max_tables)) {
+        std::uint64_t bits = cluster_contexts(tables);
+        if (bits < best_bits) {
+            best_bits = bits;
+            best_tables = tables;
+        }
+        if (tables == max_tables) {
+            break;
+        }
+    }
+    cluster_contexts(best_tables);
+}
 
-    unsigned char length_last = ubyte;
-    HNode* v = tree_root;
+/**
+ * Build the decoding table from the code lengths of the table
+ * Every entry holds the symbol whose code is at the beginning of the index and the length of the code.
+ * A table without symbols is allowed (its contexts don't occur), a single symbol has a code of length 1
+ * @param table Index of the table
+ * @return False if the lengths don't form a prefix code
+ */
+bool Huffman::build_decode_table(unsigned table) {
+    const std::size_t size = (std::size_t)1 << CONTEXT_CODE_LENGTH;
+    const unsigned char* lengths = table_lengths.data() + table * 256;
+    DecodeEntry* entries = decode_table.data() + table * size;
+    unsigned symbols = 0;
+    std::size_t kraft = 0;
+    int last = 0;
+    for (int s = 0; s < 256; s++) {
+        if (lengths[s] > CONTEXT_CODE_LENGTH) {
+            return false;
+        }
+        if (lengths[s] > 0) {
+            symbols++;
+            kraft += size >> lengths[s];
+            last = s;
+        }
+    }
+    if (symbols == 0) {
+        std::fill(entries, entries + size, DecodeEntry{0, 0});
+        return true;
+    }
+    if (symbols == 1) {
+        std::fill(entries, entries + size, DecodeEntry{(unsigned char)last, 1});
+        return lengths[last] == 1;
+    }
+    if (kraft != size) {
+        return false;
+    }
+    std::uint16_t codes_table[256];
+    canonical_codes(lengths, codes_table);
+    for (int s = 0; s < 256; s++) {
+        if (lengths[s] == 0) {
+            continue;
+        }
+        for (std::size_t i = codes_table[s]; i < size; i += (std::size_t)1 << lengths[s]) {
+            entries[i] = {(unsigned char)s, lengths[s]};
+        }
+    }
+    return true;
+}
 
-    while(file_in.get(byte)) {
-        ubyte = (unsigned char)byte;
-        cnt_bytes--;
-        int end = 8;
-        // If it is the last byte
-        if (cnt_bytes == 0) {
-            end = length_last;
+/**
+ * Order-1 encoding of the opened file after the parameters
+ * Format: varint number of symbols, number of tables, table of every context (256 bytes, only for several tables),
+ * code lengths of every table (two per byte, the lower half first), varint size of the bits, bits, checksum
+ */
+void Huffman::encode_contexts() {
+    Checksum stream_checksum(params.checksum);
+    make_context_table(stream_checksum);
+    choose_tables();
+
+    std::vector<std::uint16_t> table_codes(table_count * 256);
+    for (unsigned j = 0; j < table_count; j++) {
+        canonical_codes(table_lengths.data() + j * 256, table_codes.data() + j * 256);
+    }
+    std::uint64_t symbols = 0;
+    std::uint64_t cnt_bits = 0;
+    for (int c = 0; c < 256; c++) {
+        for (int s = 0; s < 256; s++) {
+            symbols += context_freq[c * 256 + s];
+            cnt_bits += context_freq[c * 256 + s] * table_lengths[context_map[c] * 256 + s];
         }
+    }
 
-        // Going through the tree
+    write_varint(file_out, symbols);
+    file_out.put((char)table_count);
+    if (table_count > 1) {
+        file_out.write((char*)context_map, 256);
+    }
+    for (unsigned char* lengths = table_lengths.data(); lengths != table_lengths.data() + table_lengths.size(); lengths += 2) {
+        file_out.put((char)(lengths[0] | (lengths[1] << 4)));
+    }
+    write_varint(file_out, (cnt_bits + 7) / 8);
 
-        for (int i = 0; i < end; i++) {
-            if ((1 << i) & ubyte) {
-                go_tree(v, true);
-            }
-            else {
-                go_tree(v, false);
+    // Codes and lengths of the table of every context
+    std::size_t table_offset[256];
+    for (int c = 0; c < 256; c++) {
+        table_offset[c] = (std::size_t)context_map[c] * 256;
+    }
+    auto data = context.buffers.acquire(OUT_BUFFER_SIZE);
+    auto out = context.buffers.acquire(OUT_BUFFER_SIZE);
+    std::size_t out_pos = 0;
+    std::uint64_t bit_buffer = 0;
+    unsigned bit_count = 0;
+    unsigned char prev = 0;
+    std::size_t data_size;
+    while ((data_size = file_in.read((char*)data->data(), data->size())) > 0) {
+        for (std::size_t i = 0; i < data_size; i++) {
+            unsigned char c = (*data)[i];
+            std::size_t entry = table_offset[prev] + c;
+            bit_buffer |= (std::uint64_t)table_codes[entry] << bit_count;
+            bit_count += table_lengths[entry];
+            prev = c;
+            if (bit_count >= 32) {
+                for (int j = 0; j < 4; j++) {
+                    (*out)[out_pos++] = (unsigned char)(bit_buffer >> (8 * j));
+                }
+                bit_buffer >>= 32;
+                bit_count -= 32;
+                if (out_pos + 4 > out->size()) {
+                    file_out.write((char*)out->data(), out_pos);
+                    out_pos = 0;
+                }
             }
-            if (v->contains) {
-                file_out << (char)v->symbol;
-                v = tree_root;
+        }
+    }
+    for (; bit_count > 0; bit_count -= std::min(bit_count, 8u)) {
+        (*out)[out_pos++] = (unsigned char)bit_buffer;
+        bit_buffer >>= 8;
+    }
+    file_out.write((char*)out->data(), out_pos);
+    stream_checksum.write(file_out);
+}
+
+/**
+ * Order-1 decoding of the opened file after the parameters
+ * The table is chosen through the offset of the previous byte, so every symbol is one lookup without branches
+ */
+void Huffman::decode_contexts() {
+    const std::size_t size = (std::size_t)1 << CONTEXT_CODE_LENGTH;
+    std::uint64_t symbols;
+    std::uint64_t cnt_bytes;
+    char byte;
+    if (!read_varint(file_in, symbols) || !file_in.get(byte)) {
+        throw std::runtime_error("Huffman: invalid header");
+    }
+    table_count = (unsigned char)byte;
+    std::fill(context_map, context_map + 256, 0);
+    if (table_count == 0 || table_count > MAX_TABLES ||
+        (table_count > 1 && file_in.read((char*)context_map, 256) != 256)) {
+        throw std::runtime_error("Huffman: invalid header");
+    }
+    table_lengths.resize(table_count * 256);
+    for (unsigned char* lengths = table_lengths.data(); lengths != table_lengths.data() + table_lengths.size(); lengths += 2) {
+        if (!file_in.get(byte)) {
+            throw std::runtime_error("Huffman: invalid header");
+        }
+        lengths[0] = (unsigned char)byte & 15;
+        lengths[1] = (unsigned char)byte >> 4;
+    }
+    // Every symbol takes at least one bit
+    if (!read_varint(file_in, cnt_bytes) || cnt_bytes > (UINT64_MAX >> 3) || symbols > 8 * cnt_bytes) {
+        throw std::runtime_error("Huffman: invalid header");
+    }
+    decode_table.resize(table_count * size);
+    for (unsigned j = 0; j < table_count; j++) {
+        if (!build_decode_table(j)) {
+            throw std::runtime_error("Huffman: invalid code lengths");
+        }
+    }
+    std::size_t table_offset[256];
+    for (int c = 0; c < 256; c++) {
+        if (context_map[c] >= table_count) {
+            throw std::runtime_error("Huffman: invalid header");
+        }
+        table_offset[c] = (std::size_t)context_map[c] * size;
+    }
+
+    auto in = context.buffers.acquire(OUT_BUFFER_SIZE);
+    std::size_t in_pos = 0;
+    std::size_t in_size = 0;
+    std::uint64_t remaining = cnt_bytes;
+    std::uint64_t bit_buffer = 0;
+    unsigned bit_count = 0;
+    std::uint64_t consumed = 0;
+    // Bits after the end of the data are zeros
+    auto refill = [&]() {
+        while (bit_count <= 56) {
+            if (in_pos == in_size) {
+                if (remaining == 0) {
+                    bit_count = 64;
+                    return;
+                }
+                in_size = file_in.read((char*)in->data(), (std::size_t)std::min<std::uint64_t>(remaining, in->size()));
+                if (in_size == 0) {
+                    throw std::runtime_error("Huffman: truncated file");
+                }
+                remaining -= in_size;
+                in_pos = 0;
             }
+            bit_buffer |= (std::uint64_t)(*in)[in_pos++] << bit_count;
+            bit_count += 8;
+        }
+    };
+
+    Checksum stream_checksum(params.checksum);
+    auto out_buffer = context.buffers.acquire(OUT_BUFFER_SIZE);
+    std::vector<unsigned char>& out = *out_buffer;
+    std::size_t out_pos = 0;
+    const DecodeEntry* entries = decode_table.data();
+    unsigned char prev = 0;
+    for (std::uint64_t i = 0; i < symbols; i++) {
+        if (bit_count < CONTEXT_CODE_LENGTH) {
+            refill();
+        }
+        DecodeEntry entry = entries[table_offset[prev] | (bit_buffer & (size - 1))];
+        bit_buffer >>= entry.length;
+        bit_count -= entry.length;
+        consumed += entry.length;
+        out[out_pos++] = entry.symbol;
+        prev = entry.symbol;
+        if (out_pos == out.size()) {
+            stream_checksum.update(out.data(), out_pos);
+            file_out.write((char*)out.data(), out_pos);
+            out_pos = 0;
         }
     }
+    stream_checksum.update(out.data(), out_pos);
+    file_out.write((char*)out.data(), out_pos);
+    // The data must end with the last code
+    if ((consumed + 7) / 8 != cnt_bytes || remaining != 0 || in_pos != in_size) {
+        throw std::runtime_error("Huffman: corrupted data");
+    }
+    if (!stream_checksum.check(file_in)) {
+        throw std::runtime_error("Huffman: checksum mismatch");
+    }
+}
 
+/**
+ * Huffman decoding
+ * @param filename Name of the file
+ */
+void Huffman::decode(const std::string& filename) {
+    open_files_decompress(filename);
+    decode_stream();
     close_files();
 }
+
+/**
+ * Decode the file without writing the result
+ * @param filename Name of the file
+ */
+void Huffman::verify(const std::string& filename) {
+    file_in.open(filename);
+    decode_stream();
+    file_in.close();
+}
+
+/**
+ * Huffman encoding of a buffer, the result has the same format as the encoded file
+ * @param data Source
+ * @param size Size of the source
+ * @param out Result is appended here
+ */
+void Huffman::encode_buffer(const unsigned char* data, std::size_t size, std::vector<unsigned char>& out) {
+    std::uint64_t counts[256] = {};
+    for (std::size_t i = 0; i < size; i++) {
+        counts[data[i]]++;
+    }
+    std::copy(counts, counts + 256, freq_table);
+    build_codes(params.max_code_length);
+
+    std::uint64_t cnt_bits = 0;
+    for (int i = 0; i < 256; i++) {
+        cnt_bits += counts[i] * codes[i].first;
+    }
+    std::uint64_t cnt_bytes = cnt_bits / 8 + 1;
+
+    unsigned char buf[10];
+    for (std::uint64_t i : freq_table) {
+        out.insert(out.end(), buf, buf + uint_to_varint(buf, i));
+    }
+    out.insert(out.end(), buf, buf + uint_to_varint(buf, cnt_bytes));
+    out.push_back((unsigned char)(cnt_bits % 8));
+
+    std::size_t out_pos = out.size();
+    out.resize(out_pos + cnt_bytes, 0);
+    unsigned char* dst = out.data() + out_pos;
+    std::uint64_t bit_buffer = 0;
+    int bit_count = 0;
+    for (std::size_t i = 0; i < size; i++) {
+        int length = codes[data[i]].first;
+        std::uint64_t code = codes[data[i]].second;
+        // Codes longer than 56 bits are written in two parts
+        while (length > 0) {
+            int part = std::min(length, 56 - bit_count);
+            bit_buffer |= (code & (((std::uint64_t)1 << part) - 1)) << bit_count;
+            bit_count += part;
+            code >>= part;
+            length -= part;
+            while (bit_count >= 8) {
+                *dst++ = (unsigned char)bit_buffer;
+                bit_buffer >>= 8;
+                bit_count -= 8;
+            }
+        }
+    }
+    if (bit_count > 0) {
+        *dst = (unsigned char)bit_buffer;
+    }
+}
+
+/**
+ * Huffman decoding of a buffer produced by encode_buffer
+ * @param in Source, moved past the encoded data
+ * @param end End of the source
+ * @param out Result is appended here
+ * @param max_size Maximal size of the result
+ * @return False if the source is malformed or the result is longer than max_size
+ */
+bool Huffman::decode_buffer(const unsigned char*& in, const unsigned char* end, std::vector<unsigned char>& out,
+                            std::uint64_t max_size) {
+    for (std::uint64_t& symbol : freq_table) {
+        if (!varint_to_uint(in, end, symbol)) {
+            return false;
+        }
+    }
+    std::uint64_t cnt_bytes;
+    if (!varint_to_uint(in, end, cnt_bytes) || in == end) {
+        return false;
+    }
+    unsigned char length_last = *in++;
+    if (cnt_bytes == 0 || cnt_bytes > (std::uint64_t)(end - in) || length_last >= 8) {
+        return false;
+    }
+    build_codes(64);
+
+    const unsigned char* data_end = in + cnt_bytes;
+    std::uint64_t cnt_bits = (cnt_bytes - 1) * 8 + length_last;
+    if (cnt_bits > 0 && tree_root == nullptr) {
+        return false;
+    }
+    HNode* v = tree_root;
+    const std::size_t start = out.size();
+    for (std::uint64_t i = 0; i < cnt_bits; i++) {
+        go_tree(v, (in[i / 8] >> (i % 8)) & 1);
+        if (v == nullptr) {
+            return false;
+        }
+        if (v->contains) {
+            if (out.size() - start == max_size) {
+                return false;
+            }
+            out.push_back(v->symbol);
+            v = tree_root;
+        }
+    }
+    in = data_end;
+    return v == tree_root;
+}
@@ -3,30 +3,56 @@
 #include <fstream>
 #include <string>
 #include <vector>
-#include <iostream>
 #include <queue>
+#include <algorithm>
+#include <cstdint>
 #include "utils.h"
+#include "async_io.h"
+#include "params.h"
+#include "context.h"
 
 struct HNode {
     bool contains;
     unsigned char symbol;
     HNode* l;
     HNode* r;
-    unsigned int priority;
+    std::uint64_t priority;
     HNode();
-    HNode(unsigned char ubyte, unsigned int freq);
+    HNode(unsigned char ubyte, std::uint64_t freq);
     HNode(HNode* nl, HNode* nr);
 };
 
 class Huffman {
 private:
-    std::ifstream file_in;
-    std::ofstream file_out;
-    unsigned int freq_table[256];
-    std::pair<int, int> codes[256];
+    const std::size_t OUT_BUFFER_SIZE = 1 << 20;
+    // Order-1 coding: codes are at most CONTEXT_CODE_LENGTH bits, so a symbol is decoded with one lookup
+    static constexpr unsigned CONTEXT_CODE_LENGTH = 11;
+    static constexpr unsigned MAX_TABLES = 32;
+    static constexpr unsigned KMEANS_ITERATIONS = 8;
+
+    struct DecodeEntry {
+        unsigned char symbol;
+        unsigned char length;
+    };
+
+    AsyncReader file_in;
+    AsyncWriter file_out;
+    CodecParams params;
+    std::uint64_t freq_table[256];
+    std::pair<int, std::uint64_t> codes[256];
+    // Nodes of the tree are allocated in the arena of the context, the heap keeps its capacity between trees
+    CodecContext context;
+    std::vector<HNode*> heap;
     HNode* tree_root;
 
-    void delete_tree(HNode* v);
+    // Order-1 coding: frequencies of the symbols after every byte, context_freq[previous * 256 + symbol]
+    std::vector<std::uint64_t> context_freq;
+    // Table of every context, table_count tables of 256 code lengths
+    unsigned char context_map[256];
+    unsigned table_count;
+    std::vector<unsigned char> table_lengths;
+    // 2 ^ CONTEXT_CODE_LENGTH entries for every table, indexed by the next bits of the stream
+    std::vector<DecodeEntry> decode_table;
 
     void open_files_analysis(const std::string& filename);
 
@@ -34,18 +60,108 @@ private:
 
     void close_files();
 
-    void make_freq_table();
+    void make_freq_table(Checksum& stream_checksum);
 
     HNode* make_tree();
 
-    void make_codes(HNode* node, int code, int length);
+    void make_codes(HNode* node, std::uint64_t code, int length);
 
     static void go_tree(HNode*& node, bool move);
 
+    /**
+     * Build Huffman tree and codes for the current frequency table
+     * @param max_length Maximal length of a code
+     */
+    void build_codes(unsigned max_length);
+
+    /**
+     * Decode the opened file, the result is written to file_out if it is open
+     */
+    void decode_stream();
+
+    /**
+     * Read file and find frequency for each symbol after each byte
+     * @param stream_checksum Checksum of the file is counted in the same pass
+     */
+    void make_context_table(Checksum& stream_checksum);
+
+    /**
+     * Code lengths for the current frequency table, at most CONTEXT_CODE_LENGTH
+     * @param lengths Result, 256 lengths
+     */
+    void build_lengths(unsigned char* lengths);
+
+    /**
+     * Canonical codes for the code lengths, bit-reversed because the bits are written from the lowest one
+     * @param lengths 256 code lengths
+     * @param codes Result, 256 codes
+     */
+    static void canonical_codes(const unsigned char* lengths, std::uint16_t* codes);
+
+    /**
+     * Group contexts into tables and build the code lengths of the tables
+     * @param tables Maximal number of tables
+     * @return Size of the header and the data in bits
+     */
+    std::uint64_t cluster_contexts(unsigned tables);
+
+    /**
+     * Cluster contexts with the number of tables which gives the smallest result
+     */
+    void choose_tables();
+
+    /**
+     * Build the decoding table from the code lengths of the table
+     * @param table Index of the table
+     * @return False if the lengths don't form a prefix code
+     */
+    bool build_decode_table(unsigned table);
+
+    /**
+     * Order-1 encoding of the opened file after the parameters
+     */
+    void encode_contexts();
+
+    /**
+     * Order-1 decoding of the opened file after the parameters
+     */
+    void decode_contexts();
+
 public:
-    Huffman();
+    explicit Huffman(int level = CodecParams::DEFAULT_LEVEL);
+
+    /**
+     * The file is coded as one stream without blocks, so the filters are not supported
+     * @param params_ Parameters, throws std::invalid_argument if the filter is on
+     */
+    explicit Huffman(const CodecParams& params_);
+
+    /**
+     * Huffman encoding of a buffer, the result has the same format as the encoded file
+     * @param data Source
+     * @param size Size of the source
+     * @param out Result is appended here
+     */
+    void encode_buffer(const unsigned char* data, std::size_t size, std::vector<unsigned char>& out);
+
+    /**
+     * Huffman decoding of a buffer produced by encode_buffer
+     * @param in Source, moved past the encoded data
+     * @param end End of the source
+     * @param out Result is appended here
+     * @param max_size Maximal size of the result
+     * @return False if the source is malformed or the result is longer than max_size
+     */
+    bool decode_buffer(const unsigned char*& in, const unsigned char* end, std::vector<unsigned char>& out,
+                       std::uint64_t max_size);
 
     void encode(const std::string& filename);
 
     void decode(const std::string& filename);
+
+    /**
+     * Decode the file without writing the result, throws std::runtime_error if it is damaged
+     * @param filename Name of the file
+     */
+    void verify(const std::string& filename);
 };
@@ -0,0 +1,700 @@
+#include "lz77.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+
+void LZ77::open_files_analysis(const std::string& filename) {
+    file_in.open(filename);
+    // Linux:
+    file_out.open("/tmp/" + make_filename_out_analysis(filename, 3));
+}
+
+void LZ77::open_files_decompress(const std::string& filename) {
+    file_in.open(filename);
+    file_out.open(make_filename_out_decompress(filename, 3));
+}
+
+void LZ77::close_files() {
+    file_in.close();
+    file_out.close();
+}
+
+/**
+ * Length of the common prefix, compared 8 bytes at a time
+ * @param a First string
+ * @param b Second string
+ * @param max_length Maximal length
+ * @return Length of the common prefix
+ */
+static std::size_t common_length(const unsigned char* a, const unsigned char* b, std::size_t max_length) {
+    std::size_t length = 0;
+    while (length + 8 <= max_length) {
+        std::uint64_t x, y;
+        std::memcpy(&x, a + length, 8);
+        std::memcpy(&y, b + length, 8);
+        if (x != y) {
+            return length + std::countr_zero(x ^ y) / 8;
+        }
+        length += 8;
+    }
+    while (length < max_length && a[length] == b[length]) {
+        length++;
+    }
+    return length;
+}
+
+static void append_varint(std::vector<unsigned char>& out, std::uint64_t a) {
+    unsigned char buf[10];
+    out.insert(out.end(), buf, buf + uint_to_varint(buf, a));
+}
+
+/**
+ * Entropy coding of a token stream with the coder chosen in the parameters
+ * @param stream Stream
+ * @param out Result is appended here
+ */
+void LZ77::encode_stream(const std::vector<unsigned char>& stream, std::vector<unsigned char>& out) {
+    if (params.entropy == EntropyCoder::TANS) {
+        tans.encode_buffer(stream.data(), stream.size(), out);
+    }
+    else {
+        huffman.encode_buffer(stream.data(), stream.size(), out);
+    }
+}
+
+/**
+ * Entropy decoding of a token stream with the coder chosen in the parameters
+ * @param in Source, moved past the stream
+ * @param end End of the source
+ * @param stream Result
+ * @param max_size Maximal size of the stream
+ * @return False if the stream is malformed or longer than max_size
+ */
+bool LZ77::decode_stream(const unsigned char*& in, const unsigned char* end, std::vector<unsigned char>& stream,
+                         std::uint64_t max_size) {
+    stream.clear();
+    if (params.entropy == EntropyCoder::TANS) {
+        return tans.decode_buffer(in, end, stream, max_size);
+    }
+    return huffman.decode_buffer(in, end, stream, max_size);
+}
+
+/**
+ * Hash of the first MIN_MATCH bytes at the position
+ * @param pos Position in the buffer
+ * @return Hash
+ */
+std::uint32_t LZ77::hash(std::size_t pos) const {
+    std::uint32_t x;
+    std::memcpy(&x, buffer.data() + pos, 4);
+    return (x * 2654435761u) >> (32 - HASH_LOG);
+}
+
+void LZ77::insert(std::size_t pos) {
+    std::uint32_t h = hash(pos);
+    std::size_t abs_pos = base + pos;
+    prev[abs_pos & (prev.size() - 1)] = head[h];
+    head[h] = (std::uint32_t)abs_pos + 1;
+}
+
+/**
+ * Find the longest match for the position going through the hash chain
+ * @param pos Position in the buffer
+ * @param end End of the current block
+ * @return Match (length 0 if there is none)
+ */
+LZ77::Match LZ77::find_match(std::size_t pos, std::size_t end) const {
+    Match best{0, 0};
+    std::size_t window = prev.size();
+    std::size_t max_length = std::min(MAX_MATCH, end - pos);
+    const unsigned char* cur = buffer.data() + pos;
+    std::size_t abs_pos = base + pos;
+    std::uint32_t cand = head[hash(pos)];
+    for (unsigned depth = params.search_depth; cand != 0 && depth > 0; depth--) {
+        std::size_t c = cand - 1;
+        if (c >= abs_pos || abs_pos - c > window || c < base) {
+            break;
+        }
+        const unsigned char* ref = buffer.data() + (c - base);
+        // Quick check of the byte which would make the match longer than the best one
+        if (ref[best.length] == cur[best.length]) {
+            std::size_t length = common_length(ref, cur, max_length);
+            if (length > best.length) {
+                best = {length, abs_pos - c};
+                if (length >= params.nice_length || length == max_length) {
+                    break;
+                }
+            }
+        }
+        cand = prev[c & (window - 1)];
+        // The slot was reused by a newer position: the chain is over
+        if (cand != 0 && cand - 1 >= c) {
+            break;
+        }
+    }
+    return best;
+}
+
+/**
+ * Split the block into sequences
+ * @param start Beginning of the block in the buffer
+ * @param end End of the block in the buffer
+ * @param seq Result
+ */
+void LZ77::parse_block(std::size_t start, std::size_t end, Sequences& seq) {
+    seq.literals.clear();
+    seq.literal_lengths.clear();
+    seq.match_lengths.clear();
+    seq.distances.clear();
+    seq.count = 0;
+
+    std::size_t pos = start;
+    std::size_t literal_start = start;
+    while (pos + MIN_MATCH <= end) {
+        Match match = find_match(pos, end);
+        insert(pos);
+        if (match.length < MIN_MATCH) {
+            pos++;
+            continue;
+        }
+        // Lazy matching: a longer match at the next position is better than the current one
+        while (params.lazy && match.length < params.nice_length && pos + 1 + MIN_MATCH <= end) {
+            Match next = find_match(pos + 1, end);
+            if (next.length <= match.length) {
+                break;
+            }
+            insert(pos + 1);
+            pos++;
+            match = next;
+        }
+
+        seq.literals.insert(seq.literals.end(), buffer.begin() + (long)literal_start, buffer.begin() + (long)pos);
+        append_varint(seq.literal_lengths, pos - literal_start);
+        append_varint(seq.match_lengths, match.length - MIN_MATCH);
+        append_varint(seq.distances, match.distance - 1);
+        seq.count++;
+
+        for (std::size_t i = pos + 1; i < pos + match.length && i + MIN_MATCH <= end; i++) {
+            insert(i);
+        }
+        pos += match.length;
+        literal_start = pos;
+    }
+    seq.literals.insert(seq.literals.end(), buffer.begin() + (long)literal_start, buffer.begin() + (long)end);
+}
+
+/**
+ * Start a new stream: empty buffer and hash chains
+ * Slots of prev are reached only through head, so they are not cleared
+ */
+void LZ77::reset_window() {
+    head.assign((std::size_t)1 << HASH_LOG, 0);
+    prev.resize((std::size_t)1 << params.window_log);
+    buffer.clear();
+    base = 0;
+}
+
+/**
+ * Keep only the last window of the buffer, the positions in the hash chains stay valid
+ */
+void LZ77::slide() {
+    std::size_t window = (std::size_t)1 << params.window_log;
+    if (buffer.size() > window) {
+        std::size_t removed = buffer.size() - window;
+        buffer.erase(buffer.begin(), buffer.begin() + (long)removed);
+        base += removed;
+    }
+    if (base >= REBASE_LIMIT) {
+        rebase();
+    }
+}
+
+/**
+ * Move the base back by a multiple of the window size, the positions before the buffer are dropped
+ * The slots of prev depend only on the position modulo the window, so they stay in place
+ */
+void LZ77::rebase() {
+    std::size_t window = (std::size_t)1 << params.window_log;
+    std::size_t shift = base & ~(window - 1);
+    auto rebase_chain = [shift](std::uint32_t& p) {
+        p = p > shift ? (std::uint32_t)(p - shift) : 0;
+    };
+    std::for_each(head.begin(), head.end(), rebase_chain);
+    std::for_each(prev.begin(), prev.end(), rebase_chain);
+    base -= shift;
+}
+
+/**
+ * Compress the block at the end of the buffer, the data before it is the history
+ * Hash chains are kept from the previous blocks: only the last MIN_MATCH - 1 positions of the previous block,
+ * whose hash needs the bytes of this block, are added
+ * @param start Beginning of the block in the buffer
+ * @param out Result is appended here
+ */
+void LZ77::encode_block(std::size_t start, std::vector<unsigned char>& out) {
+    std::size_t block_size = buffer.size() - start;
+    unsigned stride = block_filter_stride(params, buffer.data() + start, block_size);
+    if (stride != 0) {
+        filter_buffer.resize(block_size);
+        filter_forward(params.filter, stride, buffer.data() + start, block_size, filter_buffer.data());
+        std::copy(filter_buffer.begin(), filter_buffer.end(), buffer.begin() + (long)start);
+    }
+
+    std::size_t tail = start - std::min(start, MIN_MATCH - 1);
+    for (std::size_t pos = tail; pos < start && pos + MIN_MATCH <= buffer.size(); pos++) {
+        insert(pos);
+    }
+    parse_block(start, buffer.size(), seq);
+
+    streams.clear();
+    encode_stream(seq.literals, streams);
+    encode_stream(seq.literal_lengths, streams);
+    encode_stream(seq.match_lengths, streams);
+    encode_stream(seq.distances, streams);
+
+    append_varint(out, block_size);
+    if (params.filter != FilterKind::None) {
+        append_varint(out, stride);
+    }
+    append_varint(out, seq.count);
+    append_varint(out, streams.size());
+    out.insert(out.end(), streams.begin(), streams.end());
+}
+
+/**
+ * Decompress the streams of the block and append the block to the buffer
+ * @param block_size Size of the block
+ * @param count Number of sequences
+ * @param in Streams
+ * @param end End of the streams
+ * @return False if the block is corrupted
+ */
+bool LZ77::decode_block(std::uint64_t block_size, std::uint64_t count, const unsigned char* in, const unsigned char* end) {
+    // Every sequence ends with a match, and the token streams hold one varint per sequence
+    if (count > block_size / MIN_MATCH) {
+        return false;
+    }
+    const std::uint64_t tokens_size = 10 * count;
+    if (!decode_stream(in, end, seq.literals, block_size) || !decode_stream(in, end, seq.literal_lengths, tokens_size) ||
+        !decode_stream(in, end, seq.match_lengths, tokens_size) || !decode_stream(in, end, seq.distances, tokens_size)) {
+        return false;
+    }
+
+    std::size_t start = buffer.size();
+    std::size_t block_end = start + block_size;
+    buffer.resize(block_end);
+    unsigned char* out = buffer.data();
+    std::size_t pos = start;
+    const unsigned char* literals = seq.literals.data();
+    const unsigned char* literals_end = literals + seq.literals.size();
+    const unsigned char* ll = seq.literal_lengths.data();
+    const unsigned char* ll_end = ll + seq.literal_lengths.size();
+    const unsigned char* ml = seq.match_lengths.data();
+    const unsigned char* ml_end = ml + seq.match_lengths.size();
+    const unsigned char* dist = seq.distances.data();
+    const unsigned char* dist_end = dist + seq.distances.size();
+    for (std::uint64_t i = 0; i < count; i++) {
+        std::uint64_t literal_length, match_length, distance;
+        if (!varint_to_uint(ll, ll_end, literal_length) || !varint_to_uint(ml, ml_end, match_length) ||
+            !varint_to_uint(dist, dist_end, distance)) {
+            return false;
+        }
+        match_length += MIN_MATCH;
+        distance++;
+        if (literal_length > (std::uint64_t)(literals_end - literals) || literal_length > block_end - pos ||
+            match_length > block_end - pos - literal_length || distance > pos + literal_length) {
+            return false;
+        }
+        std::memcpy(out + pos, literals, literal_length);
+        literals += literal_length;
+        pos += literal_length;
+
+        const unsigned char* ref = out + pos - distance;
+        if (distance >= match_length) {
+            std::memcpy(out + pos, ref, match_length);
+        }
+        else {
+            // Overlapping match repeats the last distance bytes
+            for (std::uint64_t j = 0; j < match_length; j++) {
+                out[pos + j] = ref[j];
+            }
+        }
+        pos += match_length;
+    }
+    if ((std::uint64_t)(literals_end - literals) != block_end - pos) {
+        return false;
+    }
+    std::memcpy(out + pos, literals, block_end - pos);
+    return true;
+}
+
+/**
+ * Source of the block which was just decoded to the end of the buffer
+ * @param start Beginning of the block in the buffer
+ * @param stride Stride of the filter of the block, 0 - not filtered
+ * @return Source of the block, valid until the next block
+ */
+const unsigned char* LZ77::unfilter_block(std::size_t start, unsigned stride) {
+    // The history stays filtered, the matches of the next blocks refer to it
+    if (stride == 0) {
+        return buffer.data() + start;
+    }
+    std::size_t block_size = buffer.size() - start;
+    filter_buffer.resize(block_size);
+    filter_inverse(params.filter, stride, buffer.data() + start, block_size, filter_buffer.data());
+    return filter_buffer.data();
+}
+
+/**
+ * Read varint stride of the filter of the block if the filter is on
+ * @param in Source, moved past the stride
+ * @param end End of the source
+ * @param stride Result, 0 if the filter is off
+ * @return False if the stride is truncated or invalid
+ */
+bool LZ77::read_stride(const unsigned char*& in, const unsigned char* end, unsigned& stride) const {
+    stride = 0;
+    if (params.filter == FilterKind::None) {
+        return true;
+    }
+    std::uint64_t value;
+    if (!varint_to_uint(in, end, value) || value > MAX_FILTER_STRIDE) {
+        return false;
+    }
+    stride = (unsigned)value;
+    return true;
+}
+
+/**
+ * Compress the block at the end of the buffer in the file format: encode_block followed by the checksum of the streams
+ * @param start Beginning of the block in the buffer
+ * @param out Result is appended here
+ * @param stream_checksum Checksum of the whole source, the block is added to it
+ */
+void LZ77::frame_block(std::size_t start, std::vector<unsigned char>& out, Checksum& stream_checksum) {
+    stream_checksum.update(buffer.data() + start, buffer.size() - start);
+    encode_block(start, out);
+    Checksum block_checksum(params.checksum);
+    block_checksum.update(streams.data(), streams.size());
+    block_checksum.write(out);
+}
+
+LZ77::LZ77(int level): LZ77(CodecParams::from_level(level)) {}
+
+/**
+ * Parameters of the entropy coders of the token streams, the filter applies only to the source of the blocks
+ * @param params Parameters of LZ77
+ * @return Parameters without the filter
+ */
+static CodecParams stream_params(const CodecParams& params) {
+    CodecParams res = params;
+    res.filter = FilterKind::None;
+    res.filter_stride = 0;
+    return res;
+}
+
+LZ77::LZ77(const CodecParams& params_):
+        params(params_), huffman(stream_params(params_)), tans(stream_params(params_)), base(0) {}
+
+/**
+ * LZ77 encoding of a buffer, independent of the previous buffers
+ * @param data Source
+ * @param size Size of the source
+ * @param out Result is appended here
+ */
+void LZ77::encode_buffer(const unsigned char* data, std::size_t size, std::vector<unsigned char>& out) {
+    append_varint(out, size);
+    reset_window();
+    for (std::size_t offset = 0; offset < size; offset += params.block_size) {
+        std::size_t start = buffer.size();
+        buffer.insert(buffer.end(), data + offset, data + std::min(size, offset + params.block_size));
+        encode_block(start, out);
+        slide();
+    }
+}
+
+/**
+ * LZ77 decoding of a buffer produced by encode_buffer
+ * @param in Source, moved past the encoded data
+ * @param end End of the source
+ * @param out Result is appended here
+ * @return False if the source is malformed
+ */
+bool LZ77::decode_buffer(const unsigned char*& in, const unsigned char* end, std::vector<unsigned char>& out) {
+    std::uint64_t size;
+    if (!varint_to_uint(in, end, size)) {
+        return false;
+    }
+    buffer.clear();
+    std::uint64_t decoded = 0;
+    while (decoded < size) {
+        std::uint64_t block_size, count, encoded_size;
+        unsigned stride;
+        if (!varint_to_uint(in, end, block_size) || !read_stride(in, end, stride) || !varint_to_uint(in, end, count) ||
+            !varint_to_uint(in, end, encoded_size) || block_size == 0 || block_size > params.block_size ||
+            block_size > size - decoded || encoded_size > (std::uint64_t)(end - in)) {
+            return false;
+        }
+        std::size_t start = buffer.size();
+        if (!decode_block(block_size, count, in, in + encoded_size)) {
+            return false;
+        }
+        in += encoded_size;
+        const unsigned char* block = unfilter_block(start, stride);
+        out.insert(out.end(), block, block + block_size);
+        decoded += block_size;
+        slide();
+    }
+    return true;
+}
+
+/**
+ * LZ77 + Huffman encoding for the file
+ * The file starts with the parameters, then each block is stored in encode_block format
+ * (the streams are literals, literal lengths, match lengths, distances; numbers are varints)
+ * followed by the checksum of the streams. Size 0 ends the blocks and is followed by the checksum of the whole source
+ * @param filename Name of the file
+ */
+void LZ77::encode(const std::string& filename) {
+    open_files_analysis(filename);
+    write_params(file_out, params);
+    reset_window();
+
+    Checksum stream_checksum(params.checksum);
+    auto encoded_buffer = context.buffers.acquire(0);
+    std::vector<unsigned char>& encoded = *encoded_buffer;
+    while (true) {
+        std::size_t start = buffer.size();
+        buffer.resize(start + params.block_size);
+        std::size_t block_size = file_in.read((char*)buffer.data() + start, params.block_size);
+        buffer.resize(start + block_size);
+        if (block_size == 0) {
+            break;
+        }
+        encoded.clear();
+        frame_block(start, encoded, stream_checksum);
+        file_out.write((char*)encoded.data(), encoded.size());
+        slide();
+    }
+    write_varint(file_out, 0);
+    stream_checksum.write(file_out);
+    close_files();
+}
+
+/**
+ * Read the header and the streams of the next block and check the checksum of the streams
+ * @param block_size Size of the block
+ * @param count Number of sequences
+ * @param encoded Streams
+ * @return False after the last block
+ */
+bool LZ77::read_block(std::uint64_t& block_size, unsigned& stride, std::uint64_t& count, std::vector<unsigned char>& encoded) {
+    std::uint64_t encoded_size;
+    std::uint64_t block_stride = 0;
+    if (!read_varint(file_in, block_size)) {
+        throw std::runtime_error("LZ77: truncated file");
+    }
+    if (block_size == 0) {
+        return false;
+    }
+    if ((params.filter != FilterKind::None && !read_varint(file_in, block_stride)) ||
+        !read_varint(file_in, count) || !read_varint(file_in, encoded_size) || block_stride > MAX_FILTER_STRIDE ||
+        block_size > params.block_size || encoded_size > 8 * params.block_size + 4096) {
+        throw std::runtime_error("LZ77: corrupted block header");
+    }
+    stride = (unsigned)block_stride;
+    encoded.resize(encoded_size);
+    if (file_in.read((char*)encoded.data(), encoded_size) != encoded_size) {
+        throw std::runtime_error("LZ77: truncated block");
+    }
+    Checksum block_checksum(params.checksum);
+    block_checksum.update(encoded.data(), encoded.size());
+    if (!block_checksum.check(file_in)) {
+        throw std::runtime_error("LZ77: block checksum mismatch");
+    }
+    return true;
+}
+
+/**
+ * LZ77 + Huffman decoding for the file, the checksums are checked along the way
+ * @param filename Name of the file
+ */
+void LZ77::decode(const std::string& filename) {
+    open_files_decompress(filename);
+    CodecParams file_params;
+    if (!read_params(file_in, file_params)) {
+        throw std::runtime_error("LZ77: invalid header");
+    }
+    ScopedParams scoped_params(params, file_params);
+    buffer.clear();
+
+    Checksum stream_checksum(params.checksum);
+    auto encoded_buffer = context.buffers.acquire(0);
+    std::vector<unsigned char>& encoded = *encoded_buffer;
+    std::uint64_t block_size;
+    unsigned stride;
+    std::uint64_t count;
+    while (read_block(block_size, stride, count, encoded)) {
+        std::size_t start = buffer.size();
+        if (!decode_block(block_size, count, encoded.data(), encoded.data() + encoded.size())) {
+            throw std::runtime_error("LZ77: corrupted block");
+        }
+        const unsigned char* block = unfilter_block(start, stride);
+        stream_checksum.update(block, block_size);
+        file_out.write((const char*)block, block_size);
+        slide();
+    }
+    if (!stream_checksum.check(file_in)) {
+        throw std::runtime_error("LZ77: checksum mismatch");
+    }
+    close_files();
+}
+
+/**
+ * Check the checksums of the blocks without decoding them
+ * @param filename Name of the file
+ */
+void LZ77::verify(const std::string& filename) {
+    file_in.open(filename);
+    CodecParams file_params;
+    if (!read_params(file_in, file_params)) {
+        throw std::runtime_error("LZ77: invalid header");
+    }
+    ScopedParams scoped_params(params, file_params);
+    auto encoded = context.buffers.acquire(0);
+    std::uint64_t block_size;
+    unsigned stride;
+    std::uint64_t count;
+    while (read_block(block_size, stride, count, *encoded)) {}
+    // The checksum of the source can be checked only by decode
+    char stored[8];
+    std::size_t stored_size = Checksum(params.checksum).size();
+    if (file_in.read(stored, stored_size) != stored_size) {
+        throw std::runtime_error("LZ77: truncated file");
+    }
+    file_in.close();
+}
+
+/**
+ * Compression of a stream in the file format, the output is produced block by block while the input arrives.
+ * Only the window and one block are kept in memory
+ * @param input Chunks of the source, an empty chunk compresses the data received so far as a shorter block
+ * @return Chunks of the compressed stream, each one is valid until the next one is requested
+ */
+Generator<std::span<const unsigned char>> LZ77::compress_stream(Generator<std::span<const unsigned char>> input) {
+    auto out_buffer = context.buffers.acquire(0);
+    std::vector<unsigned char>& out = *out_buffer;
+    params_to_bytes(params, out);
+    co_yield std::span<const unsigned char>(out);
+
+    reset_window();
+    Checksum stream_checksum(params.checksum);
+    std::size_t start = 0;
+    for (std::span<const unsigned char> chunk : input) {
+        bool flush = chunk.empty();
+        while (!chunk.empty() || flush) {
+            std::size_t part = std::min(chunk.size(), start + params.block_size - buffer.size());
+            buffer.insert(buffer.end(), chunk.begin(), chunk.begin() + (long)part);
+            chunk = chunk.subspan(part);
+            if (buffer.size() - start < params.block_size && !(flush && buffer.size() > start)) {
+                break;
+            }
+            out.clear();
+            frame_block(start, out, stream_checksum);
+            co_yield std::span<const unsigned char>(out);
+            slide();
+            start = buffer.size();
+            flush = false;
+        }
+    }
+    out.clear();
+    if (buffer.size() > start) {
+        frame_block(start, out, stream_checksum);
+    }
+    append_varint(out, 0);
+    stream_checksum.write(out);
+    co_yield std::span<const unsigned char>(out);
+}
+
+/**
+ * Decompression of a stream in the file format, every block is returned as soon as its input has arrived
+ * Only the window, one block and one compressed block are kept in memory
+ * @param input Chunks of the compressed stream
+ * @return Chunks of the source, each one is valid until the next one is requested
+ */
+Generator<std::span<const unsigned char>> LZ77::decompress_stream(Generator<std::span<const unsigned char>> input) {
+    // Received input which is not parsed yet starts at pending_pos
+    auto pending_buffer = context.buffers.acquire(0);
+    std::vector<unsigned char>& pending = *pending_buffer;
+    std::size_t pending_pos = 0;
+    // Make at least n bytes available, unless the input ends earlier
+    auto fill = [&](std::size_t n) {
+        if (pending.size() - pending_pos >= n) {
+            return;
+        }
+        pending.erase(pending.begin(), pending.begin() + (long)pending_pos);
+        pending_pos = 0;
+        while (pending.size() < n && input.next()) {
+            pending.insert(pending.end(), input.value().begin(), input.value().end());
+        }
+    };
+
+    fill(CodecParams::MAX_HEADER_SIZE);
+    const unsigned char* in = pending.data() + pending_pos;
+    CodecParams file_params;
+    if (!bytes_to_params(in, pending.data() + pending.size(), file_params)) {
+        throw std::runtime_error("LZ77: invalid header");
+    }
+    ScopedParams scoped_params(params, file_params);
+    pending_pos = in - pending.data();
+    buffer.clear();
+    Checksum stream_checksum(params.checksum);
+    const std::size_t checksum_size = stream_checksum.size();
+    while (true) {
+        std::uint64_t block_size;
+        unsigned stride;
+        std::uint64_t count;
+        std::uint64_t encoded_size;
+        fill(4 * 10);
+        in = pending.data() + pending_pos;
+        const unsigned char* end = pending.data() + pending.size();
+        if (!varint_to_uint(in, end, block_size)) {
+            throw std::runtime_error("LZ77: truncated stream");
+        }
+        if (block_size == 0) {
+            pending_pos = in - pending.data();
+            break;
+        }
+        if (!read_stride(in, end, stride) || !varint_to_uint(in, end, count) || !varint_to_uint(in, end, encoded_size) ||
+            block_size > params.block_size || encoded_size > 8 * params.block_size + 4096) {
+            throw std::runtime_error("LZ77: corrupted block header");
+        }
+        pending_pos = in - pending.data();
+        fill(encoded_size + checksum_size);
+        if (pending.size() - pending_pos < encoded_size + checksum_size) {
+            throw std::runtime_error("LZ77: truncated block");
+        }
+        const unsigned char* encoded = pending.data() + pending_pos;
+        Checksum block_checksum(params.checksum);
+        block_checksum.update(encoded, encoded_size);
+        if (!block_checksum.check(encoded + encoded_size)) {
+            throw std::runtime_error("LZ77: block checksum mismatch");
+        }
+        std::size_t start = buffer.size();
+        if (!decode_block(block_size, count, encoded, encoded + encoded_size)) {
+            throw std::runtime_error("LZ77: corrupted block");
+        }
+        pending_pos += encoded_size + checksum_size;
+        const unsigned char* block = unfilter_block(start, stride);
+        stream_checksum.update(block, block_size);
+        co_yield std::span<const unsigned char>(block, block_size);
+        slide();
+    }
+    fill(checksum_size);
+    if (pending.size() - pending_pos < checksum_size || !stream_checksum.check(pending.data() + pending_pos)) {
+        throw std::runtime_error("LZ77: checksum mismatch");
+    }
+}
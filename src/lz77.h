@@ -0,0 +1,235 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <span>
+#include "async_io.h"
+#include "generator.h"
+#include "huffman.h"
+#include "tans.h"
+#include "params.h"
+#include "context.h"
+
+/**
+ * LZ77 with hash-chain match finder, the token streams are compressed with Huffman or tANS
+ */
+class LZ77 {
+private:
+    const std::size_t MIN_MATCH = 4;
+    const std::size_t MAX_MATCH = 1 << 16;
+    const unsigned HASH_LOG = 16;
+    // Positions in the hash chains are 32-bit, the base is moved back when it reaches this
+    const std::size_t REBASE_LIMIT = (std::size_t)1 << 31;
+
+    // Window, search depth, lazy matching and block size
+    CodecParams params;
+
+    AsyncReader file_in;
+    AsyncWriter file_out;
+    Huffman huffman;
+    TANS tans;
+
+    // Previous blocks (up to the window size) followed by the current block
+    std::vector<unsigned char> buffer;
+
+    // Hash chains: head[hash] and prev[pos & window mask] store absolute position + 1, 0 - no position
+    std::vector<std::uint32_t> head;
+    std::vector<std::uint32_t> prev;
+    // Absolute position of the beginning of the buffer, the chains are kept between blocks
+    std::size_t base;
+
+    /**
+     * Token streams of the block: sequence = literals, then match of length match_length at distance
+     */
+    struct Sequences {
+        std::vector<unsigned char> literals;
+        std::vector<unsigned char> literal_lengths;
+        std::vector<unsigned char> match_lengths;
+        std::vector<unsigned char> distances;
+        std::uint64_t count;
+    };
+
+    Sequences seq;
+    // Entropy-coded streams of the current block
+    std::vector<unsigned char> streams;
+    // The history in the buffer is filtered, blocks are filtered and restored here
+    std::vector<unsigned char> filter_buffer;
+    // Compressed blocks of the file and of the stream
+    CodecContext context;
+
+    struct Match {
+        std::size_t length;
+        std::size_t distance;
+    };
+
+    void open_files_analysis(const std::string& filename);
+
+    void open_files_decompress(const std::string& filename);
+
+    void close_files();
+
+    /**
+     * Entropy coding of a token stream with the coder chosen in the parameters
+     * @param stream Stream
+     * @param out Result is appended here
+     */
+    void encode_stream(const std::vector<unsigned char>& stream, std::vector<unsigned char>& out);
+
+    /**
+     * Entropy decoding of a token stream with the coder chosen in the parameters
+     * @param in Source, moved past the stream
+     * @param end End of the source
+     * @param stream Result
+     * @param max_size Maximal size of the stream
+     * @return False if the stream is malformed or longer than max_size
+     */
+    bool decode_stream(const unsigned char*& in, const unsigned char* end, std::vector<unsigned char>& stream,
+                       std::uint64_t max_size);
+
+    std::uint32_t hash(std::size_t pos) const;
+
+    void insert(std::size_t pos);
+
+    /**
+     * Find the longest match for the position going through the hash chain
+     * @param pos Position in the buffer
+     * @param end End of the current block
+     * @return Match (length 0 if there is none)
+     */
+    Match find_match(std::size_t pos, std::size_t end) const;
+
+    /**
+     * Split the block into sequences
+     * @param start Beginning of the block in the buffer
+     * @param end End of the block in the buffer
+     * @param seq Result
+     */
+    void parse_block(std::size_t start, std::size_t end, Sequences& seq);
+
+    /**
+     * Start a new stream: empty buffer and hash chains
+     */
+    void reset_window();
+
+    /**
+     * Keep only the last window of the buffer
+     */
+    void slide();
+
+    /**
+     * Move the base back by a multiple of the window size, the positions before the buffer are dropped
+     */
+    void rebase();
+
+    /**
+     * Compress the block at the end of the buffer, the data before it is the history
+     * The block is filtered in place first (if the filter is on)
+     * Format: varint size, varint stride of the filter (if the filter is on), varint number of sequences,
+     * varint size of the streams and four entropy-coded streams
+     * @param start Beginning of the block in the buffer
+     * @param out Result is appended here
+     */
+    void encode_block(std::size_t start, std::vector<unsigned char>& out);
+
+    /**
+     * Compress the block at the end of the buffer in the file format: encode_block followed by the checksum of the streams
+     * @param start Beginning of the block in the buffer
+     * @param out Result is appended here
+     * @param stream_checksum Checksum of the whole source, the block is added to it
+     */
+    void frame_block(std::size_t start, std::vector<unsigned char>& out, Checksum& stream_checksum);
+
+    /**
+     * Decompress the streams of the block and append the block to the buffer
+     * @param block_size Size of the block
+     * @param count Number of sequences
+     * @param in Streams
+     * @param end End of the streams
+     * @return False if the block is corrupted
+     */
+    bool decode_block(std::uint64_t block_size, std::uint64_t count, const unsigned char* in, const unsigned char* end);
+
+    /**
+     * Source of the block which was just decoded to the end of the buffer
+     * @param start Beginning of the block in the buffer
+     * @param stride Stride of the filter of the block, 0 - not filtered
+     * @return Source of the block, valid until the next block
+     */
+    const unsigned char* unfilter_block(std::size_t start, unsigned stride);
+
+    /**
+     * Read varint stride of the filter of the block if the filter is on
+     * @param in Source, moved past the stride
+     * @param end End of the source
+     * @param stride Result, 0 if the filter is off
+     * @return False if the stride is truncated or invalid
+     */
+    bool read_stride(const unsigned char*& in, const unsigned char* end, unsigned& stride) const;
+
+    /**
+     * Read the header and the streams of the next block and check the checksum of the streams
+     * @param block_size Size of the block
+     * @param stride Stride of the filter of the block
+     * @param count Number of sequences
+     * @param encoded Streams
+     * @return False after the last block
+     */
+    bool read_block(std::uint64_t& block_size, unsigned& stride, std::uint64_t& count, std::vector<unsigned char>& encoded);
+
+public:
+    explicit LZ77(int level = CodecParams::DEFAULT_LEVEL);
+
+    explicit LZ77(const CodecParams& params_);
+
+    /**
+     * LZ77 encoding of a buffer, independent of the previous buffers
+     * Format: varint size of the source, then the blocks as in the file
+     * @param data Source
+     * @param size Size of the source
+     * @param out Result is appended here
+     */
+    void encode_buffer(const unsigned char* data, std::size_t size, std::vector<unsigned char>& out);
+
+    /**
+     * LZ77 decoding of a buffer produced by encode_buffer
+     * @param in Source, moved past the encoded data
+     * @param end End of the source
+     * @param out Result is appended here
+     * @return False if the source is malformed
+     */
+    bool decode_buffer(const unsigned char*& in, const unsigned char* end, std::vector<unsigned char>& out);
+
+    /**
+     * LZ77 + Huffman encoding for the file
+     * @param filename Name of the file
+     */
+    void encode(const std::string& filename);
+
+    /**
+     * LZ77 + Huffman decoding for the file
+     * @param filename Name of the file
+     */
+    void decode(const std::string& filename);
+
+    /**
+     * Check the file without decoding it, throws std::runtime_error if it is damaged
+     * @param filename Name of the file
+     */
+    void verify(const std::string& filename);
+
+    /**
+     * Compression of a stream, the result is the same as the content of the compressed file
+     * The object must outlive the generator and can't be used by anything else until it is finished
+     * @param input Chunks of the source, an empty chunk compresses the data received so far as a shorter block
+     * @return Chunks of the compressed stream, each one is valid until the next one is requested
+     */
+    Generator<std::span<const unsigned char>> compress_stream(Generator<std::span<const unsigned char>> input);
+
+    /**
+     * Decompression of a stream produced by compress_stream or encode
+     * The object must outlive the generator and can't be used by anything else until it is finished
+     * @param input Chunks of the compressed stream
+     * @return Chunks of the source, each one is valid until the next one is requested
+     */
+    Generator<std::span<const unsigned char>> decompress_stream(Generator<std::span<const unsigned char>> input);
+};
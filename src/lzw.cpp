@@ -1,18 +1,293 @@
 #include "lzw.h"
 #include "utils.h"
 
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+
+static const std::uint32_t EMPTY_KEY = UINT32_MAX;
+
 void LZW::open_files_analysis(const std::string &filename) {
     file_in.open(filename);
     // Linux:
-    file_out.open("/tmp/" + make_filename_out_analysis(filename, 0), std::ios::binary | std::ios::out | std::ios::app);
+    file_out.open("/tmp/" + make_filename_out_analysis(filename, 0));
 }
 
 void LZW::open_files_decompress(const std::string &filename) {
     file_in.open(filename);
-    file_out.open(make_filename_out_decompress(filename, 0), std::ios::binary | std::ios::out | std::ios::app);
+    file_out.open(make_filename_out_decompress(filename, 0));
 }
 
 void LZW::close_files() {
     file_in.close();
-    file_out.close()
+    file_out.close();
+}
+
+/**
+ * Width of the next code
+ * The decoder knows the dictionary one entry later than the encoder, so the encoder passes next_code - 1
+ * @param next_code Next free code of the decoder
+ * @param max_bits Maximal width
+ * @return Number of bits
+ */
+unsigned LZW::code_width(unsigned next_code, unsigned max_bits) {
+    auto width = (unsigned)std::bit_width(next_code);
+    return std::min(std::max(width, MIN_BITS), max_bits);
+}
+
+void LZW::write_code(unsigned code, unsigned width) {
+    bit_buffer |= (std::uint64_t)code << bit_count;
+    bit_count += width;
+    while (bit_count >= 8) {
+        file_out.put((char)(bit_buffer & 255));
+        bit_buffer >>= 8;
+        bit_count -= 8;
+    }
+}
+
+void LZW::flush_codes() {
+    if (bit_count > 0) {
+        file_out.put((char)(bit_buffer & 255));
+    }
+    bit_buffer = 0;
+    bit_count = 0;
+}
+
+bool LZW::read_code(unsigned& code, unsigned width) {
+    char byte;
+    while (bit_count < width) {
+        if (!file_in.get(byte)) {
+            return false;
+        }
+        bit_buffer |= (std::uint64_t)(unsigned char)byte << bit_count;
+        bit_count += 8;
+    }
+    code = (unsigned)(bit_buffer & ((1u << width) - 1));
+    bit_buffer >>= width;
+    bit_count -= width;
+    return true;
+}
+
+std::size_t LZW::find_slot(std::uint32_t key) const {
+    std::size_t mask = hash_keys.size() - 1;
+    auto shift = 64 - std::countr_zero(hash_keys.size());
+    std::size_t slot = (std::size_t)(((std::uint64_t)key * 0x9E3779B97F4A7C15ull) >> shift);
+    while (hash_keys[slot] != EMPTY_KEY && hash_keys[slot] != key) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * Write the string of the code into the output buffer
+ * If the previous occurrence of the string is still in the buffer it is copied, otherwise the string is
+ * written back to front by going through the prefixes
+ * @param code Code
+ * @param dst Destination with room for length[code] bytes
+ */
+void LZW::emit_string(unsigned code, unsigned char* dst) const {
+    if (code < 256) {
+        dst[0] = (unsigned char)code;
+        return;
+    }
+    std::uint32_t len = length[code];
+    if (start[code] >= out_base) {
+        std::memcpy(dst, out.data() + (start[code] - out_base), len);
+        return;
+    }
+    unsigned char* p = dst + len;
+    while (code >= 256) {
+        *--p = last[code];
+        code = prefix[code];
+    }
+    *--p = (unsigned char)code;
+}
+
+LZW::LZW(int level): LZW(CodecParams::from_level(level)) {}
+
+/**
+ * The file is coded as one stream without blocks, so the filters are not supported
+ * @param params_ Parameters, throws std::invalid_argument if the filter is on
+ */
+LZW::LZW(const CodecParams& params_): params(params_), out_base(0), bit_buffer(0), bit_count(0) {
+    if (params.filter != FilterKind::None) {
+        throw std::invalid_argument("LZW: filters are not supported");
+    }
+}
+
+/**
+ * LZW encoding with variable-width codes
+ * The file starts with the parameters (maximal width of the codes among them),
+ * the codes end with STOP_CODE and are followed by the checksum of the source
+ * @param filename Name of the file
+ */
+void LZW::encode(const std::string& filename) {
+    open_files_analysis(filename);
+    write_params(file_out, params);
+    bit_buffer = 0;
+    bit_count = 0;
+
+    const unsigned max_bits = params.lzw_max_bits;
+    const unsigned max_codes = 1u << max_bits;
+    hash_keys.assign((std::size_t)max_codes * 2, EMPTY_KEY);
+    hash_codes.resize(hash_keys.size());
+    unsigned next_code = FIRST_CODE;
+
+    Checksum stream_checksum(params.checksum);
+    auto data_buffer = context.buffers.acquire(OUT_BUFFER_SIZE);
+    std::vector<unsigned char>& data = *data_buffer;
+    std::size_t data_size;
+    bool has_prefix = false;
+    unsigned w = 0;
+    while ((data_size = file_in.read((char*)data.data(), data.size())) > 0) {
+        stream_checksum.update(data.data(), data_size);
+        for (std::size_t i = 0; i < data_size; i++) {
+            unsigned char c = data[i];
+            if (!has_prefix) {
+                w = c;
+                has_prefix = true;
+                continue;
+            }
+            std::uint32_t key = (w << 8) | c;
+            std::size_t slot = find_slot(key);
+            if (hash_keys[slot] == key) {
+                w = hash_codes[slot];
+                continue;
+            }
+            write_code(w, code_width(next_code - 1, max_bits));
+            hash_keys[slot] = key;
+            hash_codes[slot] = next_code++;
+            if (next_code == max_codes) {
+                write_code(CLEAR_CODE, code_width(next_code - 1, max_bits));
+                std::fill(hash_keys.begin(), hash_keys.end(), EMPTY_KEY);
+                next_code = FIRST_CODE;
+            }
+            w = c;
+        }
+    }
+    if (has_prefix) {
+        write_code(w, code_width(next_code - 1, max_bits));
+    }
+    // The decoder has added the entry for the last code by now
+    write_code(STOP_CODE, code_width(next_code, max_bits));
+    flush_codes();
+    stream_checksum.write(file_out);
+    close_files();
+}
+
+/**
+ * Decode the opened file, the result is written to file_out if it is open
+ * Strings are written directly to their final position in the output buffer
+ */
+void LZW::decode_stream() {
+    bit_buffer = 0;
+    bit_count = 0;
+
+    CodecParams file_params;
+    if (!read_params(file_in, file_params) || file_params.filter != FilterKind::None) {
+        throw std::runtime_error("LZW: invalid header");
+    }
+    ScopedParams scoped_params(params, file_params);
+    const unsigned max_bits = params.lzw_max_bits;
+    const unsigned max_codes = 1u << max_bits;
+    prefix.resize(max_codes);
+    last.resize(max_codes);
+    length.resize(max_codes);
+    start.resize(max_codes);
+    for (unsigned i = 0; i < 256; i++) {
+        last[i] = (unsigned char)i;
+        length[i] = 1;
+    }
+    // The longest string is shorter than the dictionary
+    out.resize(std::max<std::size_t>(OUT_BUFFER_SIZE, max_codes));
+    out_base = 0;
+    std::size_t out_pos = 0;
+
+    unsigned next_code = FIRST_CODE;
+    bool has_prev = false;
+    unsigned prev = 0;
+    std::uint64_t prev_start = 0;
+    Checksum stream_checksum(params.checksum);
+    unsigned code;
+    while (true) {
+        if (!read_code(code, code_width(next_code, max_bits))) {
+            throw std::runtime_error("LZW: truncated file");
+        }
+        if (code == STOP_CODE) {
+            break;
+        }
+        if (code == CLEAR_CODE) {
+            next_code = FIRST_CODE;
+            has_prev = false;
+            continue;
+        }
+        if (code > next_code || code >= max_codes || (code == next_code && !has_prev) ||
+            (code >= 256 && code < FIRST_CODE)) {
+            throw std::runtime_error("LZW: invalid code");
+        }
+
+        std::uint32_t len = code == next_code ? length[prev] + 1 : length[code];
+        if (out_pos + len > out.size()) {
+            stream_checksum.update(out.data(), out_pos);
+            file_out.write((char*)out.data(), out_pos);
+            out_base += out_pos;
+            out_pos = 0;
+        }
+        unsigned char* dst = out.data() + out_pos;
+        std::uint64_t cur_start = out_base + out_pos;
+        if (code == next_code) {
+            // KwKwK: string of the previous code followed by its own first byte
+            if (prev_start >= out_base) {
+                std::memcpy(dst, out.data() + (prev_start - out_base), len - 1);
+            }
+            else {
+                emit_string(prev, dst);
+            }
+            dst[len - 1] = dst[0];
+        }
+        else {
+            emit_string(code, dst);
+        }
+
+        if (has_prev && next_code < max_codes) {
+            prefix[next_code] = prev;
+            last[next_code] = dst[0];
+            length[next_code] = length[prev] + 1;
+            start[next_code] = prev_start;
+            next_code++;
+        }
+        prev = code;
+        prev_start = cur_start;
+        has_prev = true;
+        out_pos += len;
+    }
+    stream_checksum.update(out.data(), out_pos);
+    file_out.write((char*)out.data(), out_pos);
+    // The rest of the last byte of the codes is padding
+    bit_buffer = 0;
+    bit_count = 0;
+    if (!stream_checksum.check(file_in)) {
+        throw std::runtime_error("LZW: checksum mismatch");
+    }
+}
+
+/**
+ * LZW decoding
+ * @param filename Name of the file
+ */
+void LZW::decode(const std::string& filename) {
+    open_files_decompress(filename);
+    decode_stream();
+    close_files();
+}
+
+/**
+ * Decode the file without writing the result
+ * @param filename Name of the file
+ */
+void LZW::verify(const std::string& filename) {
+    file_in.open(filename);
+    decode_stream();
+    file_in.close();
 }
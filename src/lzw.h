@@ -3,17 +3,102 @@
 #include <string>
 #include <fstream>
 #include <vector>
+#include <cstdint>
+#include "async_io.h"
+#include "params.h"
+#include "context.h"
 
 class LZW {
 private:
-    std::ifstream file_in;
-    std::ofstream file_out;
+    // Special codes: reset of the dictionary and end of the stream
+    static constexpr unsigned CLEAR_CODE = 256;
+    static constexpr unsigned STOP_CODE = 257;
+    static constexpr unsigned FIRST_CODE = 258;
+    static constexpr unsigned MIN_BITS = 9;
+    const std::size_t OUT_BUFFER_SIZE = 1 << 20;
+
+    // Width of the codes grows from MIN_BITS up to params.lzw_max_bits, then the dictionary is cleared
+    CodecParams params;
+
+    AsyncReader file_in;
+    AsyncWriter file_out;
+
+    // Encoder dictionary: open addressing table (prefix code, byte) -> code
+    std::vector<std::uint32_t> hash_keys;
+    std::vector<std::uint32_t> hash_codes;
+
+    // Decoder string table: string of the code is the string of prefix followed by last
+    std::vector<std::uint32_t> prefix;
+    std::vector<unsigned char> last;
+    std::vector<std::uint32_t> length;
+    // Position of the first occurrence of the string in the output
+    std::vector<std::uint64_t> start;
+    std::vector<unsigned char> out;
+    std::uint64_t out_base;
+
+    std::uint64_t bit_buffer;
+    unsigned bit_count;
+
+    // Input buffer of the encoder
+    CodecContext context;
 
     void open_files_analysis(const std::string& filename);
 
     void open_files_decompress(const std::string& filename);
 
     void close_files();
+
+    static unsigned code_width(unsigned next_code, unsigned max_bits);
+
+    void write_code(unsigned code, unsigned width);
+
+    void flush_codes();
+
+    bool read_code(unsigned& code, unsigned width);
+
+    /**
+     * Find the slot of (prefix, byte) in the encoder dictionary
+     * @param key (prefix << 8) | byte
+     * @return Slot with this key or an empty slot
+     */
+    std::size_t find_slot(std::uint32_t key) const;
+
+    /**
+     * Write the string of the code into the output buffer
+     * @param code Code
+     * @param dst Destination with room for length[code] bytes
+     */
+    void emit_string(unsigned code, unsigned char* dst) const;
+
+    /**
+     * Decode the opened file, the result is written to file_out if it is open
+     */
+    void decode_stream();
+
 public:
+    explicit LZW(int level = CodecParams::DEFAULT_LEVEL);
+
+    /**
+     * The file is coded as one stream without blocks, so the filters are not supported
+     * @param params_ Parameters, throws std::invalid_argument if the filter is on
+     */
+    explicit LZW(const CodecParams& params_);
+
+    /**
+     * LZW encoding with variable-width codes
+     * @param filename Name of the file
+     */
+    void encode(const std::string& filename);
+
+    /**
+     * LZW decoding
+     * @param filename Name of the file
+     */
+    void decode(const std::string& filename);
 
+    /**
+     * Decode the file without writing the result, throws std::runtime_error if it is damaged
+     * @param filename Name of the file
+     */
+    void verify(const std::string& filename);
 };
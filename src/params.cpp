@@ -0,0 +1,158 @@
+#include "params.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+CodecParams CodecParams::from_level(int level) {
+    level = std::clamp(level, MIN_LEVEL, MAX_LEVEL);
+    static const std::size_t block_sizes[MAX_LEVEL] = {
+        1 << 16, 1 << 17, 1 << 18, 1 << 19, 1 << 20, 1 << 21, 1 << 22, 1 << 23, 1 << 23
+    };
+    static const unsigned search_depths[MAX_LEVEL] = {4, 8, 12, 16, 32, 64, 128, 256, 1024};
+    static const unsigned window_logs[MAX_LEVEL] = {16, 16, 17, 17, 18, 19, 20, 21, 22};
+    static const unsigned nice_lengths[MAX_LEVEL] = {16, 32, 32, 64, 258, 258, 1024, 4096, 65536};
+
+    CodecParams params{};
+    params.level = level;
+    params.block_size = block_sizes[level - 1];
+    // A run of two inside non-repeated bytes is cheaper to keep there
+    params.min_repeat = level < 5 ? 2 : 3;
+    params.max_run = 127;
+    params.max_code_length = level <= 3 ? 12 : (level <= 6 ? 16 : 24);
+    params.huffman_tables = level <= 2 ? 1 : (level <= 6 ? 16 : 32);
+    params.lzw_max_bits = level <= 3 ? 12 : (level <= 6 ? 16 : 20);
+    params.window_log = window_logs[level - 1];
+    params.search_depth = search_depths[level - 1];
+    params.lazy = level >= 4;
+    params.nice_length = nice_lengths[level - 1];
+    params.entropy = EntropyCoder::TANS;
+    params.checksum = ChecksumKind::CRC32C;
+    params.filter = FilterKind::None;
+    params.filter_stride = 0;
+    return params;
+}
+
+bool CodecParams::valid() const {
+    return level >= MIN_LEVEL && level <= MAX_LEVEL &&
+           block_size > 0 && block_size <= ((std::size_t)1 << 30) &&
+           min_repeat >= 2 && min_repeat <= max_run && max_run <= 127 &&
+           max_code_length >= 9 && max_code_length <= 64 &&
+           huffman_tables >= 1 && huffman_tables <= 32 &&
+           lzw_max_bits >= 9 && lzw_max_bits <= 20 &&
+           window_log >= 8 && window_log <= 24 &&
+           search_depth > 0 && nice_length > 0 &&
+           (entropy == EntropyCoder::Huffman || entropy == EntropyCoder::TANS) &&
+           (unsigned)checksum <= (unsigned)ChecksumKind::XXH64 &&
+           (unsigned)filter <= (unsigned)FilterKind::DeltaSplit && filter_stride <= MAX_FILTER_STRIDE;
+}
+
+void params_to_bytes(const CodecParams& params, std::vector<unsigned char>& out) {
+    const std::uint64_t fields[CodecParams::FIELDS] = {
+        params.block_size, params.min_repeat, params.max_run, params.max_code_length, params.lzw_max_bits,
+        params.window_log, params.search_depth, params.lazy, params.nice_length, (unsigned)params.entropy,
+        (unsigned)params.checksum, params.huffman_tables, (unsigned)params.filter, params.filter_stride
+    };
+    unsigned char buf[10];
+    out.push_back(CodecParams::FORMAT_VERSION);
+    out.push_back((unsigned char)params.level);
+    for (std::uint64_t field : fields) {
+        out.insert(out.end(), buf, buf + uint_to_varint(buf, field));
+    }
+}
+
+void write_params(AsyncWriter& file_out, const CodecParams& params) {
+    std::vector<unsigned char> bytes;
+    params_to_bytes(params, bytes);
+    file_out.write((char*)bytes.data(), bytes.size());
+}
+
+/**
+ * Fill the parameters from the fields of the header
+ * @param level Level byte
+ * @param fields Varint fields in the order of params_to_bytes
+ * @param params Result
+ * @return False if the parameters are invalid
+ */
+static bool fields_to_params(unsigned char level, const std::uint64_t* fields, CodecParams& params) {
+    for (std::size_t i = 0; i < CodecParams::FIELDS; i++) {
+        if (fields[i] > UINT32_MAX) {
+            return false;
+        }
+    }
+    params.level = level;
+    params.block_size = fields[0];
+    params.min_repeat = (unsigned)fields[1];
+    params.max_run = (unsigned)fields[2];
+    params.max_code_length = (unsigned)fields[3];
+    params.lzw_max_bits = (unsigned)fields[4];
+    params.window_log = (unsigned)fields[5];
+    params.search_depth = (unsigned)fields[6];
+    params.lazy = fields[7] != 0;
+    params.nice_length = (unsigned)fields[8];
+    params.entropy = (EntropyCoder)fields[9];
+    params.checksum = (ChecksumKind)fields[10];
+    params.huffman_tables = (unsigned)fields[11];
+    params.filter = (FilterKind)fields[12];
+    params.filter_stride = (unsigned)fields[13];
+    return params.valid();
+}
+
+/**
+ * Check the version byte of the header
+ * @param version Version byte
+ */
+static void check_version(unsigned char version) {
+    if (version != CodecParams::FORMAT_VERSION) {
+        bool old_header = version >= CodecParams::MIN_LEVEL && version <= CodecParams::MAX_LEVEL;
+        throw std::runtime_error(old_header ? "Unsupported format: header without version" :
+                                 "Unsupported format version " + std::to_string(version));
+    }
+}
+
+bool read_params(AsyncReader& file_in, CodecParams& params) {
+    char byte;
+    if (!file_in.get(byte)) {
+        return false;
+    }
+    check_version((unsigned char)byte);
+    if (!file_in.get(byte)) {
+        return false;
+    }
+    std::uint64_t fields[CodecParams::FIELDS];
+    for (std::uint64_t& field : fields) {
+        if (!read_varint(file_in, field)) {
+            return false;
+        }
+    }
+    return fields_to_params((unsigned char)byte, fields, params);
+}
+
+bool bytes_to_params(const unsigned char*& in, const unsigned char* end, CodecParams& params) {
+    if (in == end) {
+        return false;
+    }
+    check_version(*in++);
+    if (in == end) {
+        return false;
+    }
+    unsigned char level = *in++;
+    std::uint64_t fields[CodecParams::FIELDS];
+    for (std::uint64_t& field : fields) {
+        if (!varint_to_uint(in, end, field)) {
+            return false;
+        }
+    }
+    return fields_to_params(level, fields, params);
+}
+
+unsigned block_filter_stride(const CodecParams& params, const unsigned char* data, std::size_t size) {
+    if (params.filter == FilterKind::None) {
+        return 0;
+    }
+    if (params.filter_stride != 0) {
+        return params.filter_stride;
+    }
+    return detect_stride(params.filter, data, size);
+}
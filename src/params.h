@@ -0,0 +1,144 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "async_io.h"
+#include "checksum.h"
+#include "filter.h"
+
+/**
+ * Entropy coder used for the streams inside other codecs
+ */
+enum class EntropyCoder : unsigned {
+    Huffman = 0,
+    TANS = 1
+};
+
+/**
+ * Tuning parameters shared by all codecs
+ * Every compressed file starts with them, so the decoder always uses the settings of the encoder
+ */
+struct CodecParams {
+    static constexpr int MIN_LEVEL = 1;
+    static constexpr int MAX_LEVEL = 9;
+    static constexpr int DEFAULT_LEVEL = 5;
+
+    // Header: version byte, level byte and FIELDS varints
+    // Headers without the version started with the level, so versions start above MAX_LEVEL
+    static constexpr unsigned char FORMAT_VERSION = 16;
+    static constexpr std::size_t FIELDS = 14;
+    static constexpr std::size_t MAX_HEADER_SIZE = 2 + 10 * FIELDS;
+
+    int level;
+
+    // Size of BWT (RLE) and LZ77 blocks
+    std::size_t block_size;
+
+    // RLE: runs shorter than min_repeat are stored as non-repeated bytes, blocks are at most max_run long
+    unsigned min_repeat;
+    unsigned max_run;
+
+    // Huffman: maximal length of a code
+    unsigned max_code_length;
+
+    // Huffman: maximal number of code tables, the table of a symbol is chosen by the previous byte
+    // 1 - order-0 coding with one table
+    unsigned huffman_tables;
+
+    // LZW: maximal width of a code (dictionary size is 2 ^ lzw_max_bits)
+    unsigned lzw_max_bits;
+
+    // LZ77: logarithm of the window size, number of checked candidates,
+    // lazy matching and the length of a match which stops the search
+    unsigned window_log;
+    unsigned search_depth;
+    bool lazy;
+    unsigned nice_length;
+
+    // Entropy coder for the LZ77 token streams
+    EntropyCoder entropy;
+
+    // Checksum of every block and of the whole decoded stream
+    ChecksumKind checksum;
+
+    // Filter of the blocks (RLE, LZ77 and tANS), records of filter_stride bytes, 0 - detected for every block
+    // Huffman and LZW code the file as one stream and reject it
+    FilterKind filter;
+    unsigned filter_stride;
+
+    /**
+     * Parameters for the compression level
+     * @param level From MIN_LEVEL (fastest) to MAX_LEVEL (densest), clamped to this range
+     * @return Parameters
+     */
+    static CodecParams from_level(int level = DEFAULT_LEVEL);
+
+    /**
+     * Check that the parameters are in the range supported by the codecs
+     * @return True if the parameters are valid
+     */
+    bool valid() const;
+};
+
+/**
+ * Parameters of the file being decoded, the codec uses them until the end of the scope
+ * Then its own parameters are restored, so decoding doesn't change the settings of the next encoding
+ */
+class ScopedParams {
+private:
+    CodecParams& params;
+    CodecParams saved;
+
+public:
+    ScopedParams(CodecParams& params_, const CodecParams& file_params): params(params_), saved(params_) {
+        params = file_params;
+    }
+
+    ScopedParams(const ScopedParams&) = delete;
+
+    ScopedParams& operator=(const ScopedParams&) = delete;
+
+    ~ScopedParams() {
+        params = saved;
+    }
+};
+
+/**
+ * Serialize parameters in the header format
+ * @param params Parameters
+ * @param out Result is appended here
+ */
+void params_to_bytes(const CodecParams& params, std::vector<unsigned char>& out);
+
+/**
+ * Write parameters to the header of the file (version byte, level byte and varints)
+ * @param file_out File
+ * @param params Parameters
+ */
+void write_params(AsyncWriter& file_out, const CodecParams& params);
+
+/**
+ * Read parameters from the header of the file, throws std::runtime_error if the format version is not supported
+ * @param file_in File
+ * @param params Result
+ * @return False if the header is truncated or invalid
+ */
+bool read_params(AsyncReader& file_in, CodecParams& params);
+
+/**
+ * Read parameters from the header in memory, throws std::runtime_error if the format version is not supported
+ * @param in Source, moved past the header
+ * @param end End of the source
+ * @param params Result
+ * @return False if the header is truncated or invalid
+ */
+bool bytes_to_params(const unsigned char*& in, const unsigned char* end, CodecParams& params);
+
+/**
+ * Stride of the filter for the block: the fixed one from the parameters or the detected one
+ * @param params Parameters
+ * @param data Block
+ * @param size Size of the block
+ * @return Stride, 0 if the block is not filtered
+ */
+unsigned block_filter_stride(const CodecParams& params, const unsigned char* data, std::size_t size);
@@ -1,63 +1,252 @@
 #include "rle.h"
 #include "utils.h"
 
+#include <stdexcept>
+#include <thread>
 
-PolyHash::PolyHash(const std::basic_string<unsigned char>& str) {
+
+PolyHash::PolyHash(std::span<const unsigned char> str, Arena& arena) {
     std::size_t str_size = str.size();
 
     // Count powers p1 ^ k and p2 ^ k, where k <= str_size
-    powers1.resize(str_size + 1);
-    powers2.resize(str_size + 1);
+    powers1 = arena.allocate<std::uint32_t>(str_size + 1);
+    powers2 = arena.allocate<std::uint32_t>(str_size + 1);
     powers1[0] = 1;
     powers2[0] = 1;
-    for (int i = 1; i <= str_size; i++) {
-        powers1[i] = (powers1[i - 1] * p1) % Mod1;
+    for (std::size_t i = 1; i <= str_size; i++) {
+        powers1[i] = (std::uint32_t)((powers1[i - 1] * p1) % Mod1);
+    }
+    for (std::size_t i = 1; i <= str_size; i++) {
+        powers2[i] = (std::uint32_t)((powers2[i - 1] * p2) % Mod2);
     }
-    for (int i = 1; i <= str_size; i++) {
-        powers2[i] = (powers2[i - 1] * p2) % Mod2;
+    if (str_size == 0) {
+        return;
     }
 
     // Count prefix-hashes
-    pref1.resize(str_size);
-    pref2.resize(str_size);
+    pref1 = arena.allocate<std::uint32_t>(str_size);
+    pref2 = arena.allocate<std::uint32_t>(str_size);
     pref1[0] = str[0];
     pref2[0] = str[0];
-    for (int i = 1; i < str_size; i++) {
-        pref1[i] = (pref1[i - 1] * p1 + str[i]) % Mod1;
-        pref2[i] = (pref2[i - 1] * p2 + str[i]) % Mod2;
+    for (std::size_t i = 1; i < str_size; i++) {
+        pref1[i] = (std::uint32_t)((pref1[i - 1] * p1 + str[i]) % Mod1);
+        pref2[i] = (std::uint32_t)((pref2[i - 1] * p2 + str[i]) % Mod2);
     }
 }
 
 /**
- * Get double hash for the substring
+ * Get double hash for the substring which doesn't wrap around
  * @param l Left position
  * @param r Right Postion
  * @return Double hash
  */
-inline std::pair<long long, long long> PolyHash::operator() (const int l, const int r) const {
+inline std::pair<long long, long long> PolyHash::linear(const std::size_t l, const std::size_t r) const {
     long long big1 = pref1[r];
     long long big2 = pref2[r];
     long long small1 = 0;
     long long small2 = 0;
     if (l > 0) {
-        small1 = (pref1[l - 1] * powers1[r - l + 1]) % Mod1;
-        small2 = (pref2[l - 1] * powers2[r - l + 1]) % Mod2;
+        small1 = (pref1[l - 1] * (long long)powers1[r - l + 1]) % Mod1;
+        small2 = (pref2[l - 1] * (long long)powers2[r - l + 1]) % Mod2;
     }
     big1 = (big1 - small1 + Mod1) % Mod1;
     big2 = (big2 - small2 + Mod2) % Mod2;
     return std::make_pair(big1, big2);
 }
 
+/**
+ * Get double hash for the substring of the cyclic string
+ * The substring which wraps around is the tail of the string followed by its head
+ * @param l Left position, less than the size of the string
+ * @param r Right Postion, r - l is less than the size of the string
+ * @return Double hash
+ */
+inline std::pair<long long, long long> PolyHash::operator() (const std::size_t l, const std::size_t r) const {
+    std::size_t n = pref1.size();
+    if (r < n) {
+        return linear(l, r);
+    }
+    auto [tail1, tail2] = linear(l, n - 1);
+    auto [head1, head2] = linear(0, r - n);
+    std::size_t head_length = r - n + 1;
+    return std::make_pair((tail1 * powers1[head_length] + head1) % Mod1,
+                          (tail2 * powers2[head_length] + head2) % Mod2);
+}
+
+/**
+ * Stable merge sort, same order as std::stable_sort, which allocates its own buffer on every call
+ * Runs of RUN elements are sorted by insertion, then merged back and forth between the array and the buffer
+ * @param a Array
+ * @param buffer Buffer of the same size
+ * @param less Comparator
+ */
+template <typename Less>
+static void merge_sort(std::span<std::uint32_t> a, std::span<std::uint32_t> buffer, Less less) {
+    const std::size_t RUN = 8;
+    std::size_t n = a.size();
+    for (std::size_t start = 0; start < n; start += RUN) {
+        std::size_t end = std::min(start + RUN, n);
+        for (std::size_t i = start + 1; i < end; i++) {
+            std::uint32_t x = a[i];
+            std::size_t j = i;
+            while (j > start && less(x, a[j - 1])) {
+                a[j] = a[j - 1];
+                j--;
+            }
+            a[j] = x;
+        }
+    }
+    std::span<std::uint32_t> from = a, to = buffer;
+    for (std::size_t width = RUN; width < n; width *= 2) {
+        for (std::size_t start = 0; start < n; start += 2 * width) {
+            std::size_t middle = std::min(start + width, n);
+            std::size_t end = std::min(start + 2 * width, n);
+            std::merge(from.begin() + (std::ptrdiff_t)start, from.begin() + (std::ptrdiff_t)middle,
+                       from.begin() + (std::ptrdiff_t)middle, from.begin() + (std::ptrdiff_t)end,
+                       to.begin() + (std::ptrdiff_t)start, less);
+        }
+        std::swap(from, to);
+    }
+    if (from.data() != a.data()) {
+        std::copy(from.begin(), from.end(), a.begin());
+    }
+}
+
+/**
+ * Sort the shifts bucket by bucket, buckets are sorted independently and may be done in parallel
+ * Work is split into pieces of about the same size: neighbouring small buckets are grouped,
+ * large buckets are cut into several pieces, which are merged pairwise after sorting.
+ * Both sorting and merging are stable, so the order is the same as of merge_sort of every bucket
+ * @param pos Shifts, grouped by buckets
+ * @param buffer Buffer of the same size
+ * @param bucket_start Beginnings of the buckets in pos followed by its size
+ * @param less Comparator, consistent with the order of buckets
+ * @param pool Threads for the pieces and the merges
+ * @param arena Memory for the lists of pieces and merges
+ */
+template <typename Less>
+static void sort_buckets(std::span<std::uint32_t> pos, std::span<std::uint32_t> buffer,
+                         std::span<const std::uint32_t> bucket_start, Less less, ThreadPool& pool, Arena& arena) {
+    const std::size_t MIN_PIECE = 1 << 14;
+    const std::size_t PIECES_PER_THREAD = 4;
+
+    struct Piece {
+        std::uint32_t begin;
+        std::uint32_t end;
+        // Bucket of the beginning
+        std::uint32_t bucket;
+    };
+    // Bucket cut into several pieces: cuts[first] is its beginning, then the ends of its runs
+    struct SplitBucket {
+        std::uint32_t first;
+        std::uint32_t runs;
+    };
+
+    std::size_t n = pos.size();
+    std::size_t piece_size = std::max(MIN_PIECE, n / (pool.size() * PIECES_PER_THREAD));
+    auto bucket_of = [&](std::size_t i) {
+        return (std::uint32_t)(std::upper_bound(bucket_start.begin(), bucket_start.end(), i) - bucket_start.begin() - 1);
+    };
+
+    // Every piece but the last is at least piece_size long
+    std::span<Piece> pieces = arena.allocate<Piece>(n / piece_size + 1);
+    std::size_t piece_count = 0;
+    for (std::size_t begin = 0; begin < n;) {
+        std::size_t end = begin + piece_size;
+        if (end >= n) {
+            end = n;
+        }
+        else {
+            std::uint32_t bucket = bucket_of(end);
+            // Small bucket is not cut, the piece takes the rest of it
+            if (bucket_start[bucket] != end && bucket_start[bucket + 1] - bucket_start[bucket] <= piece_size) {
+                end = bucket_start[bucket + 1];
+            }
+        }
+        pieces[piece_count++] = {(std::uint32_t)begin, (std::uint32_t)end, bucket_of(begin)};
+        begin = end;
+    }
+
+    auto sort_piece = [&](std::size_t i) {
+        const Piece& piece = pieces[i];
+        std::size_t bucket = piece.bucket;
+        for (std::size_t begin = piece.begin; begin < piece.end; bucket++) {
+            std::size_t end = std::min<std::size_t>(piece.end, bucket_start[bucket + 1]);
+            if (end - begin > 1) {
+                merge_sort(pos.subspan(begin, end - begin), buffer.subspan(begin, end - begin), less);
+            }
+            begin = end;
+        }
+    };
+    pool.parallel_for(piece_count, sort_piece);
+
+    // Cuts inside the buckets: every cut bucket has its beginning, the cuts and its end
+    std::span<std::uint32_t> cuts = arena.allocate<std::uint32_t>(3 * piece_count);
+    std::span<SplitBucket> splits = arena.allocate<SplitBucket>(piece_count);
+    std::size_t cut_count = 0;
+    std::size_t split_count = 0;
+    std::size_t last_bucket = bucket_start.size();
+    for (std::size_t i = 1; i < piece_count; i++) {
+        std::uint32_t cut = pieces[i].begin;
+        std::uint32_t bucket = pieces[i].bucket;
+        if (bucket_start[bucket] == cut) {
+            continue;
+        }
+        if (bucket != last_bucket) {
+            if (split_count > 0) {
+                cuts[cut_count++] = bucket_start[last_bucket + 1];
+            }
+            splits[split_count++] = {(std::uint32_t)cut_count, 1};
+            cuts[cut_count++] = bucket_start[bucket];
+            last_bucket = bucket;
+        }
+        cuts[cut_count++] = cut;
+        splits[split_count - 1].runs++;
+    }
+    if (split_count > 0) {
+        cuts[cut_count++] = bucket_start[last_bucket + 1];
+    }
+
+    // Merge neighbouring runs of the cut buckets, all merges of a round are independent
+    struct Merge {
+        std::uint32_t split;
+        std::uint32_t run;
+    };
+    std::span<Merge> merges = arena.allocate<Merge>(piece_count);
+    for (std::size_t width = 1;; width *= 2) {
+        std::size_t merge_count = 0;
+        for (std::size_t i = 0; i < split_count; i++) {
+            for (std::size_t run = 0; run + width < splits[i].runs; run += 2 * width) {
+                merges[merge_count++] = {(std::uint32_t)i, (std::uint32_t)run};
+            }
+        }
+        if (merge_count == 0) {
+            break;
+        }
+        auto merge_runs = [&](std::size_t i) {
+            const SplitBucket& split = splits[merges[i].split];
+            std::size_t run = merges[i].run;
+            auto begin = (std::ptrdiff_t)cuts[split.first + run];
+            auto middle = (std::ptrdiff_t)cuts[split.first + run + width];
+            auto end = (std::ptrdiff_t)cuts[split.first + std::min<std::size_t>(run + 2 * width, split.runs)];
+            std::merge(pos.begin() + begin, pos.begin() + middle, pos.begin() + middle, pos.begin() + end,
+                       buffer.begin() + begin, less);
+            std::copy(buffer.begin() + begin, buffer.begin() + end, pos.begin() + begin);
+        };
+        pool.parallel_for(merge_count, merge_runs);
+    }
+}
+
 void RLE::open_files_analysis(const std::string& filename) {
     file_in.open(filename);
     // Linux:
-    file_out.open("/tmp/" + make_filename_out_analysis(filename, 1), std::ios::binary | std::ios::out | std::ios::app);
+    file_out.open("/tmp/" + make_filename_out_analysis(filename, 1));
 
 };
 
 void RLE::open_files_decompress(const std::string& filename) {
     file_in.open(filename);
-    file_out.open(make_filename_out_decompress(filename, 1), std::ios::binary | std::ios::out | std::ios::app);
+    file_out.open(make_filename_out_decompress(filename, 1));
 };
 
 void RLE::close_files() {
@@ -67,25 +256,52 @@ void RLE::close_files() {
 
 /**
  * Burrows–Wheeler transform using polynomial hash
- * @param str Source string
- * @return Pair of transformation result and position of source string in the table of shifts
+ * Cyclic shifts are compared in place, position i of the shift p is str[(p + i) % n]
+ * Hash tables and shifts are allocated in the arena, which is cleared for every block.
+ * Buckets of shifts are sorted on the thread pool, the result doesn't depend on the number of threads
+ * @param str Source block
+ * @param out Transformation result, same size as the source
+ * @return Position of source string in the table of shifts
  */
-std::pair<std::basic_string<unsigned char>, unsigned int> RLE::bwt_encode_hash(const std::basic_string<unsigned char>& str) {
-    std::basic_string<unsigned char> a = str + str;
+std::uint32_t RLE::bwt_encode_hash(std::span<const unsigned char> str, std::span<unsigned char> out) {
     std::size_t n = str.size();
-    PolyHash hash(a);
+    context.arena.reset();
+    PolyHash hash(str, context.arena);
+    auto at = [&](std::size_t i) {
+        return str[i < n ? i : i - n];
+    };
 
     // Make cyclic shifts (cyclic shift = position of the first element in the new string)
-    std::vector<int> pos(n);
-    for (int i = 0; i < n; i++) {
-        pos[i] = i;
+    // and put them into buckets by the first two bytes, in the order of positions
+    auto bucket_key = [&](std::size_t i) {
+        return ((std::size_t)str[i] << 8) | at(i + 1);
+    };
+    std::span<std::uint32_t> bucket_start = context.arena.allocate<std::uint32_t>(BUCKETS + 1);
+    std::span<std::uint32_t> bucket_next = context.arena.allocate<std::uint32_t>(BUCKETS);
+    std::fill(bucket_start.begin(), bucket_start.end(), 0);
+    for (std::size_t i = 0; i < n; i++) {
+        bucket_start[bucket_key(i) + 1]++;
+    }
+    for (std::size_t b = 0; b < BUCKETS; b++) {
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    std::copy(bucket_start.begin(), bucket_start.end() - 1, bucket_next.begin());
+    std::span<std::uint32_t> pos = context.arena.allocate<std::uint32_t>(n);
+    for (std::size_t i = 0; i < n; i++) {
+        pos[bucket_next[bucket_key(i)]++] = (std::uint32_t)i;
+    }
+
+    if (!pool || pool->size() != threads) {
+        pool = std::make_unique<ThreadPool>(threads - 1);
     }
 
     // Sorting by the length of the longest common prefix (using polynomial hash)
-    std::stable_sort(pos.begin(), pos.end(), [&](const int p1, const int p2) {
-        int l = 0, r = (int)n + 1;
+    // The comparator orders shifts by the first two bytes too, so the buckets are already in place
+    // and every bucket keeps the order of positions, as the stable sort of all shifts would
+    auto less = [&](const std::uint32_t p1, const std::uint32_t p2) {
+        std::size_t l = 0, r = n + 1;
         while (r - l > 1) {
-            int m = (l + r) / 2;
+            std::size_t m = (l + r) / 2;
             if (m == 0) {
                 l = m;
             }
@@ -99,92 +315,88 @@ std::pair<std::basic_string<unsigned char>, unsigned int> RLE::bwt_encode_hash(c
 
         // If there is no common prefix
         if (l == 0) {
-            return a[p1] < a[p2];
+            return str[p1] < str[p2];
         }
 
         // Otherwise, we look at the next character after the common prefix
-        return l < n && a[p1 + l] < a[p2 + l];
-    });
+        return l < n && at(p1 + l) < at(p2 + l);
+    };
+    sort_buckets(pos, context.arena.allocate<std::uint32_t>(n), bucket_start, less, *pool, context.arena);
 
     // k - position of source string in the table
-    unsigned int k = std::find(pos.begin(), pos.end(), 0) - pos.begin();
+    auto k = (std::uint32_t)(std::find(pos.begin(), pos.end(), 0) - pos.begin());
 
     // Answer is the last column of the table
-    std::basic_string<unsigned char> res;
-    for (int p : pos) {
-        res += a[p + n - 1];
+    for (std::size_t i = 0; i < n; i++) {
+        out[i] = at(pos[i] + n - 1);
     }
-    return make_pair(res, k);
+    return k;
 }
 
 /**
  * Inverse Burrows–Wheeler transform
+ * The table of links is allocated in the arena
  * @param s BWT result
  * @param k Position of source string in the table of shifts
- * @return Source string
+ * @param out Source string, same size as the BWT result
  */
-std::basic_string<unsigned char> RLE::bwt_decode(std::basic_string<unsigned char> s, unsigned int k) {
-    std::vector<int> count(256);
+void RLE::bwt_decode(std::span<const unsigned char> s, std::uint32_t k, std::span<unsigned char> out) {
+    std::uint32_t count[256] = {};
     for (unsigned char c : s) {
         count[int(c)]++;
     }
-    int sum = 0;
+    std::uint32_t sum = 0;
     for (int i = 0; i < 256; i++) {
         sum = sum + count[i];
         count[i] = sum - count[i];
     }
     std::size_t n = s.size();
-    std::vector<int> t(n);
-    for (int i = 0; i < n; i++) {
-        t[count[(int)s[i]]] = i;
+    context.arena.reset();
+    std::span<std::uint32_t> t = context.arena.allocate<std::uint32_t>(n);
+    for (std::size_t i = 0; i < n; i++) {
+        t[count[(int)s[i]]] = (std::uint32_t)i;
         count[(int)s[i]]++;
     }
-    int j = t[k];
-    std::basic_string<unsigned char> res;
-    for (int i = 0; i < n; i++) {
-        res += s[j];
+    std::uint32_t j = t[k];
+    for (std::size_t i = 0; i < n; i++) {
+        out[i] = s[j];
         j = t[j];
     }
-    return res;
 }
 
 /**
- * Structure for representing repeating blocks
+ * Write bytes of the repeated and non-repeated blocks, they are added to the block checksum
+ * @param data Bytes
+ * @param size Number of bytes
  */
-struct RLE::Block {
-    int start;
-    int length;
-    unsigned char c;
-    Block() = default;
-    Block(int start_, int length_, unsigned char c_) {
-        start = start_;
-        length = length_;
-        c = c_;
-    }
-};
+void RLE::write_stored(const unsigned char* data, std::size_t size) {
+    block_checksum.update(data, size);
+    file_out.write((const char*)data, size);
+}
+
+/**
+ * Read bytes of the repeated and non-repeated blocks, they are added to the block checksum
+ * @param dst Destination
+ * @param size Number of bytes
+ * @return False if the file is truncated
+ */
+bool RLE::read_stored(unsigned char* dst, std::size_t size) {
+    std::size_t received = file_in.read((char*)dst, size);
+    block_checksum.update(dst, received);
+    return received == size;
+}
 
 /**
  * Write non-repeated block to file
- * @param pos Position of the beginning of the block
- * @param length_no_repeat Length of the block
- * @param data String
+ * Blocks longer than max_run are split into several
+ * @param data Bytes of the block
  */
-void RLE::write_no_repeat(int pos, int length_no_repeat, const std::basic_string<unsigned char>& data) {
-    int z_parts = length_no_repeat / 127;
-    auto remaining = (unsigned char)(length_no_repeat % 127);
-    for (int part = 0; part < z_parts; part++) {
-        file_out.write((char*)&MAX_NO_REPEAT, sizeof(MAX_NO_REPEAT));
-        for (int i = 0; i < MAX_NO_REPEAT; i++) {
-            file_out.write((char*)&data[pos], sizeof(data[pos]));
-            pos++;
-        }
-    }
-    if (remaining > 0) {
-        file_out.write((char*)&remaining, sizeof(remaining));
-        for (int i = 0; i < remaining; i++) {
-            file_out.write((char*)&data[pos], sizeof(data[pos]));
-            pos++;
-        }
+void RLE::write_no_repeat(std::span<const unsigned char> data) {
+    while (!data.empty()) {
+        auto length = (unsigned char)std::min<std::size_t>(data.size(), params.max_run);
+        write_stored(&length, sizeof(length));
+        write_stored(data.data(), length);
+        data = data.subspan(length);
     }
 }
 
@@ -193,160 +405,224 @@ void RLE::write_no_repeat(int pos, int length_no_repeat, const std::basic_string
  * @param length_repeat Length of the block
  * @param c Repeated symbol
  */
-void RLE::write_repeat(int length_repeat, unsigned char c) {
-    int z_parts = length_repeat / 127;
-    auto remaining = (unsigned char)(length_repeat % 127);
-    for (int part = 0; part < z_parts; part++) {
-        file_out.write((char*)&MAX_REPEAT, sizeof(MAX_REPEAT));
-        file_out.write((char*)&c, sizeof(c));
+void RLE::write_repeat(std::size_t length_repeat, unsigned char c) {
+    const unsigned char max_repeat[2] = {(unsigned char)(params.max_run | 128), c};
+    std::size_t z_parts = length_repeat / params.max_run;
+    auto remaining = (unsigned char)(length_repeat % params.max_run);
+    for (std::size_t part = 0; part < z_parts; part++) {
+        write_stored(max_repeat, sizeof(max_repeat));
     }
     if (remaining > 0) {
-        remaining = (unsigned char)(remaining | 128);
-        file_out.write((char*)&remaining, sizeof(remaining));
-        file_out.write((char*)&c, sizeof(c));
+        const unsigned char last[2] = {(unsigned char)(remaining | 128), c};
+        write_stored(last, sizeof(last));
     }
 }
 
-RLE::RLE() = default;
-
 /**
- * Run-length encoding using Burrows–Wheeler transform for the file
- * @param filename Name of the file
+ * Split BWT result into repeated and non-repeated blocks and write them to file
+ * Runs of at least min_repeat bytes become repeated blocks, the bytes between them are written as they are
+ * @param bwt_udata BWT result
  */
-void RLE::encode(const std::string& filename) {
-    // Read file
-    open_files_analysis(filename);
-    std::streampos start = file_in.tellg();
-    file_in.seekg(0, std::ios::end);
-    std::streampos end = file_in.tellg();
-    file_in.seekg(0, std::ios::beg);
-    std::vector<char> data;
-    data.resize(static_cast<std::size_t>(end - start));
-    file_in.read(&data[0], (long)data.size());
-
-    // Convert to unsigned char
-    std::basic_string<unsigned char> udata;
-    for (char c : data) {
-        udata += (unsigned char)c;
-    }
-
-    // BWT
-    std::pair<std::basic_string<unsigned char>, int> bwt = bwt_encode_hash(udata);
-    std::basic_string<unsigned char> bwt_udata = bwt.first;
-    unsigned int k = bwt.second;
-
-    // Write k to file (split k into 4 unsigned chars)
-    unsigned char k_chars[4];
-    int_to_chars(k_chars, k);
-    for (unsigned char& k_char : k_chars) {
-        file_out.write((char*)&k_char, sizeof(k_char));
-    }
-
-    // Making repeating blocks
+void RLE::write_blocks(std::span<const unsigned char> bwt_udata) {
     // The first bit of the number is a type (0 - non-repeated, 1 - repeated), other bits are the number of symbols
     std::size_t size = bwt_udata.size();
-    std::vector<Block> blocks;
-    int cur_length = 1;
-    int cur_start = 0;
-    for (int i = 1; i < size; i++) {
-        if (bwt_udata[i] == bwt_udata[i - 1]) {
-            cur_length++;
+    std::size_t no_repeat_start = 0;
+    std::size_t i = 0;
+    while (i < size) {
+        std::size_t j = i + 1;
+        while (j < size && bwt_udata[j] == bwt_udata[i]) {
+            j++;
         }
-        else {
-            if (cur_length > 1) {
-                blocks.emplace_back(cur_start, cur_length, bwt_udata[i - 1]);
-            }
-            cur_length = 1;
-            cur_start = i;
+        if (j - i >= params.min_repeat) {
+            write_no_repeat(bwt_udata.subspan(no_repeat_start, i - no_repeat_start));
+            write_repeat(j - i, bwt_udata[i]);
+            no_repeat_start = j;
         }
+        i = j;
     }
-    if (cur_length > 1) {
-        blocks.emplace_back(cur_start, cur_length, bwt_udata.back());
-    }
-    std::size_t blocks_cnt = blocks.size();
+    write_no_repeat(bwt_udata.subspan(no_repeat_start));
+}
 
-    // Write blocks
-    if (blocks_cnt > 0 && blocks[0].start > 0) {
-        write_no_repeat(0, blocks[0].start, bwt_udata);
-    }
-    for (int bl = 0; bl < blocks_cnt; bl++) {
-        RLE::Block cur_block = blocks[bl];
-        write_repeat(cur_block.length, cur_block.c);
-        if (bl + 1 != blocks_cnt) {
-            RLE::Block next_block = blocks[bl + 1];
-            int length_no_repeat = next_block.start - (cur_block.start + cur_block.length);
-            if (length_no_repeat > 0) {
-                write_no_repeat(cur_block.start + cur_block.length, length_no_repeat, bwt_udata);
+/**
+ * Read repeated and non-repeated blocks until the BWT result is restored
+ * @param res BWT result, its size is the length of the result
+ * @return False if the file is truncated or the blocks don't fit into the result
+ */
+bool RLE::read_blocks(std::span<unsigned char> res) {
+    unsigned char ubyte;
+    std::size_t pos = 0;
+    while (pos < res.size()) {
+        if (!read_stored(&ubyte, 1)) {
+            return false;
+        }
+        std::size_t count = ubyte & 127;
+        if (count > res.size() - pos) {
+            return false;
+        }
+        if (128 & ubyte) {
+            unsigned char c;
+            if (!read_stored(&c, 1)) {
+                return false;
             }
+            std::fill_n(res.begin() + (std::ptrdiff_t)pos, count, c);
         }
+        else if (!read_stored(res.data() + pos, count)) {
+            return false;
+        }
+        pos += count;
     }
-    if (blocks_cnt > 0 && blocks.back().start + blocks.back().length != size) {
-        int length_no_repeat = (int)size - (blocks.back().start + blocks.back().length);
-        write_no_repeat(blocks.back().start + blocks.back().length, length_no_repeat, bwt_udata);
+    return true;
+}
+
+/**
+ * Read the next block up to the BWT result and check its checksum
+ * @param bwt_data BWT result
+ * @param k Position of source string in the table of shifts
+ * @param stride Stride of the filter of the block, 0 - not filtered
+ * @return False after the last block
+ */
+bool RLE::read_block(std::vector<unsigned char>& bwt_data, std::uint32_t& k, unsigned& stride) {
+    std::uint64_t length;
+    std::uint64_t index;
+    if (!read_varint(file_in, length)) {
+        throw std::runtime_error("RLE: truncated file");
     }
-    if (blocks_cnt == 0) {
-        write_no_repeat(0, (int)size, bwt_udata);
+    if (length == 0) {
+        return false;
     }
+    std::uint64_t block_stride = 0;
+    if (!read_varint(file_in, index) || length > params.block_size || index >= length ||
+        (params.filter != FilterKind::None && !read_varint(file_in, block_stride)) || block_stride > MAX_FILTER_STRIDE) {
+        throw std::runtime_error("RLE: corrupted block header");
+    }
+    bwt_data.resize(length);
+    block_checksum.reset();
+    if (!read_blocks(bwt_data)) {
+        throw std::runtime_error("RLE: corrupted block");
+    }
+    if (!block_checksum.check(file_in)) {
+        throw std::runtime_error("RLE: block checksum mismatch");
+    }
+    k = (std::uint32_t)index;
+    stride = (unsigned)block_stride;
+    return true;
+}
+
+RLE::RLE(int level): RLE(CodecParams::from_level(level)) {}
+
+RLE::RLE(const CodecParams& params_): params(params_), threads(std::max(1u, std::thread::hardware_concurrency())) {}
+
+/**
+ * Set the number of threads for the BWT of a block
+ * @param threads_ Number of threads, 1 - sort on the calling thread only
+ */
+void RLE::set_threads(unsigned threads_) {
+    threads = std::max(1u, threads_);
+}
+
+/**
+ * Run-length encoding using Burrows–Wheeler transform for the file
+ * Blocks are read straight into one buffer and transformed into another, both are taken from the context
+ * and reused for all blocks and files. The filter (if it is on) is applied before the BWT.
+ * Every block ends with the checksum of its repeated and non-repeated blocks,
+ * length 0 ends the file and is followed by the checksum of the whole source
+ * @param filename Name of the file
+ */
+void RLE::encode(const std::string& filename) {
+    // Read file block by block
+    open_files_analysis(filename);
+    write_params(file_out, params);
+    block_checksum = Checksum(params.checksum);
+    Checksum stream_checksum(params.checksum);
+    auto data = context.buffers.acquire(params.block_size);
+    auto bwt_data = context.buffers.acquire(params.block_size);
+    auto filtered = context.buffers.acquire(params.filter != FilterKind::None ? params.block_size : 0);
+    std::size_t data_size;
+    while ((data_size = file_in.read((char*)data->data(), data->size())) > 0) {
+        stream_checksum.update(data->data(), data_size);
+        const unsigned char* block = data->data();
+        unsigned stride = block_filter_stride(params, block, data_size);
+        if (stride != 0) {
+            filter_forward(params.filter, stride, block, data_size, filtered->data());
+            block = filtered->data();
+        }
+        std::span<unsigned char> bwt_udata(bwt_data->data(), data_size);
+        std::uint32_t k = bwt_encode_hash(std::span<const unsigned char>(block, data_size), bwt_udata);
+
+        // Block header: length of the block, k and the stride of the filter
+        write_varint(file_out, data_size);
+        write_varint(file_out, k);
+        if (params.filter != FilterKind::None) {
+            write_varint(file_out, stride);
+        }
+
+        block_checksum.reset();
+        write_blocks(bwt_udata);
+        block_checksum.write(file_out);
+    }
+    write_varint(file_out, 0);
+    stream_checksum.write(file_out);
     close_files();
 }
 
 /**
  * Decoding run-length encoding using Burrows–Wheeler transform for the file
+ * The checksums are checked along the way
  * @param filename Name of the file
  */
 void RLE::decode(const std::string& filename) {
     open_files_decompress(filename);
-    char byte;
-    unsigned char ubyte;
-    int cnt_bytes = 0;
-    unsigned char cnt_not_repeated = 0;
-    unsigned char to_repeat = 0;
-    bool repeat = false;
-    bool is_num = true;
-    std::basic_string<unsigned char> res;
-    unsigned char k_chars[4];
-    while (file_in.get(byte)) {
-        ubyte = (unsigned char)byte;
-        if (cnt_bytes < 4) {
-            k_chars[cnt_bytes] = ubyte;
-            cnt_bytes++;
-            continue;
-        }
-        if (is_num) {
-            repeat = false;
-            is_num = false;
-            if (128 & ubyte) {
-                to_repeat = ubyte - 128;
-                repeat = true;
-            }
-            else {
-                cnt_not_repeated = ubyte;
-            }
-        }
-        else {
-            if (repeat) {
-                for (unsigned char i = 0; i < to_repeat; i++) {
-                    res += ubyte;
-                }
-                is_num = true;
-            }
-            else {
-                res += ubyte;
-                cnt_not_repeated--;
-                if (cnt_not_repeated == 0) {
-                    is_num = true;
-                }
-            }
+    CodecParams file_params;
+    if (!read_params(file_in, file_params)) {
+        throw std::runtime_error("RLE: invalid header");
+    }
+    ScopedParams scoped_params(params, file_params);
+    block_checksum = Checksum(params.checksum);
+    Checksum stream_checksum(params.checksum);
+    auto bwt_data = context.buffers.acquire(0);
+    auto data = context.buffers.acquire(0);
+    auto filtered = context.buffers.acquire(0);
+    std::uint32_t k;
+    unsigned stride;
+    while (read_block(*bwt_data, k, stride)) {
+        data->resize(bwt_data->size());
+        bwt_decode(*bwt_data, k, *data);
+        const unsigned char* block = data->data();
+        if (stride != 0) {
+            filtered->resize(data->size());
+            filter_inverse(params.filter, stride, block, data->size(), filtered->data());
+            block = filtered->data();
         }
-        cnt_bytes++;
+        stream_checksum.update(block, data->size());
+        file_out.write((const char*)block, data->size());
     }
-    unsigned int k = chars_to_int(k_chars);
-    res = bwt_decode(res, k);
-
-    std::string res_char;
-    for (unsigned char c : res) {
-        res_char += (char)c;
+    if (!stream_checksum.check(file_in)) {
+        throw std::runtime_error("RLE: checksum mismatch");
     }
-    file_out << res_char;
     close_files();
 }
+
+/**
+ * Check the checksums of the blocks without the inverse BWT
+ * @param filename Name of the file
+ */
+void RLE::verify(const std::string& filename) {
+    file_in.open(filename);
+    CodecParams file_params;
+    if (!read_params(file_in, file_params)) {
+        throw std::runtime_error("RLE: invalid header");
+    }
+    ScopedParams scoped_params(params, file_params);
+    block_checksum = Checksum(params.checksum);
+    auto bwt_data = context.buffers.acquire(0);
+    std::uint32_t k;
+    unsigned stride;
+    while (read_block(*bwt_data, k, stride)) {}
+    // The checksum of the source can be checked only by decode
+    char stored[8];
+    std::size_t stored_size = block_checksum.size();
+    if (file_in.read(stored, stored_size) != stored_size) {
+        throw std::runtime_error("RLE: truncated file");
+    }
+    file_in.close();
+}
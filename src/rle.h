@@ -1,12 +1,20 @@
 #pragma once
 
+#include <cstdint>
 #include <fstream>
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <span>
+#include <memory>
+#include "async_io.h"
+#include "params.h"
+#include "context.h"
+#include "thread_pool.h"
 
 /**
-* Structure for counting double polynomial hash of the string
+* Structure for counting double polynomial hash of the cyclic string
+* Substrings may wrap around the end, so the string doesn't have to be doubled
 */
 struct PolyHash {
 
@@ -15,30 +23,43 @@ struct PolyHash {
     const long long Mod1 = 556556107;
     const long long Mod2 = 2e9 + 11;
 
-    std::vector<long long> powers1;
-    std::vector<long long> powers2;
+    // Both modules are below 2 ^ 32, the tables are allocated in the arena
+    std::span<std::uint32_t> powers1;
+    std::span<std::uint32_t> powers2;
 
-    std::vector<long long> pref1;
-    std::vector<long long> pref2;
+    std::span<std::uint32_t> pref1;
+    std::span<std::uint32_t> pref2;
 
 
-    explicit PolyHash(const std::basic_string<unsigned char>& str);
+    PolyHash(std::span<const unsigned char> str, Arena& arena);
 
     /**
-     * Get double hash for the substring
-     * @param l Left position
-     * @param r Right Postion
+     * Get double hash for the substring of the cyclic string
+     * @param l Left position, less than the size of the string
+     * @param r Right Postion, r - l is less than the size of the string
      * @return Double hash
      */
-    inline std::pair<long long, long long> operator() (int l, int r) const;
+    inline std::pair<long long, long long> operator() (std::size_t l, std::size_t r) const;
+
+private:
+    inline std::pair<long long, long long> linear(std::size_t l, std::size_t r) const;
 };
 
 class RLE {
 private:
-    const unsigned char MAX_REPEAT = 255;
-    const unsigned char MAX_NO_REPEAT = 127;
-    std::ifstream file_in;
-    std::ofstream file_out;
+    // BWT works on blocks of params.block_size, so that positions inside the block fit into uint32_t
+    CodecParams params;
+    AsyncReader file_in;
+    AsyncWriter file_out;
+    // Checksum of the repeated and non-repeated blocks of the current BWT block
+    Checksum block_checksum;
+    // Block buffers and BWT scratch arrays
+    CodecContext context;
+    // Shifts are put into buckets by the first two bytes before sorting
+    static constexpr std::size_t BUCKETS = 1 << 16;
+    // Threads for sorting the shifts, the pool is created with the first block
+    unsigned threads;
+    std::unique_ptr<ThreadPool> pool;
 
     void open_files_analysis(const std::string& filename);
 
@@ -48,44 +69,85 @@ private:
 
     /**
      * Burrows–Wheeler transform using polynomial hash
-     * @param str Source string
-     * @return Pair of transformation result and position of source string in the table of shifts
+     * @param str Source block
+     * @param out Transformation result, same size as the source
+     * @return Position of source string in the table of shifts
      */
-    static std::pair<std::basic_string<unsigned char>, unsigned int> bwt_encode_hash(const std::basic_string<unsigned char>& str);
+    std::uint32_t bwt_encode_hash(std::span<const unsigned char> str, std::span<unsigned char> out);
 
     /**
      * Inverse Burrows–Wheeler transform
      * @param s BWT result
      * @param k Position of source string in the table of shifts
-     * @return Source string
+     * @param out Source string, same size as the BWT result
+     */
+    void bwt_decode(std::span<const unsigned char> s, std::uint32_t k, std::span<unsigned char> out);
+
+    /**
+     * Write bytes of the repeated and non-repeated blocks, they are added to the block checksum
+     * @param data Bytes
+     * @param size Number of bytes
      */
-    static std::basic_string<unsigned char> bwt_decode(std::basic_string<unsigned char> s, unsigned int k);
+    void write_stored(const unsigned char* data, std::size_t size);
 
     /**
-     * Structure for representing repeating blocks
+     * Read bytes of the repeated and non-repeated blocks, they are added to the block checksum
+     * @param dst Destination
+     * @param size Number of bytes
+     * @return False if the file is truncated
      */
-    struct Block;
+    bool read_stored(unsigned char* dst, std::size_t size);
 
     /**
      * Write non-repeated block to file
-     * @param pos Position of the beginning of the block
-     * @param length_no_repeat Length of the block
-     * @param data String
+     * @param data Bytes of the block
      */
-    void write_no_repeat(int pos, int length_no_repeat, const std::basic_string<unsigned char>& data);
+    void write_no_repeat(std::span<const unsigned char> data);
 
     /**
      * Write repeated block to file
      * @param length_repeat Length of the block
      * @param c Repeated symbol
      */
-    void write_repeat(int length_repeat, unsigned char c);
+    void write_repeat(std::size_t length_repeat, unsigned char c);
+
+    /**
+     * Split BWT result into repeated and non-repeated blocks and write them to file
+     * @param bwt_udata BWT result
+     */
+    void write_blocks(std::span<const unsigned char> bwt_udata);
+
+    /**
+     * Read repeated and non-repeated blocks until the BWT result is restored
+     * @param res BWT result, its size is the length of the result
+     * @return False if the file is truncated or the blocks don't fit into the result
+     */
+    bool read_blocks(std::span<unsigned char> res);
+
+    /**
+     * Read the next block up to the BWT result and check its checksum
+     * @param bwt_data BWT result
+     * @param k Position of source string in the table of shifts
+     * @param stride Stride of the filter of the block, 0 - not filtered
+     * @return False after the last block
+     */
+    bool read_block(std::vector<unsigned char>& bwt_data, std::uint32_t& k, unsigned& stride);
 
 public:
-    RLE();
+    explicit RLE(int level = CodecParams::DEFAULT_LEVEL);
+
+    explicit RLE(const CodecParams& params_);
+
+    /**
+     * Set the number of threads for the BWT of a block, the result doesn't depend on it
+     * @param threads_ Number of threads, 1 - sort on the calling thread only
+     */
+    void set_threads(unsigned threads_);
 
     /**
      * Run-length encoding using Burrows–Wheeler transform for the file
+     * Each block is stored as varint length, varint BWT index, varint filter stride (if the filter is on)
+     * and the repeating blocks
      * @param filename Name of the file
      */
     void encode(const std::string& filename);
@@ -95,4 +157,10 @@ public:
      * @param filename Name of the file
      */
     void decode(const std::string& filename);
+
+    /**
+     * Check the file without the inverse BWT, throws std::runtime_error if it is damaged
+     * @param filename Name of the file
+     */
+    void verify(const std::string& filename);
 };
@@ -0,0 +1,430 @@
+#include "tans.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+void TANS::open_files_analysis(const std::string& filename) {
+    file_in.open(filename);
+    // Linux:
+    file_out.open("/tmp/" + make_filename_out_analysis(filename, 4));
+}
+
+void TANS::open_files_decompress(const std::string& filename) {
+    file_in.open(filename);
+    file_out.open(make_filename_out_decompress(filename, 4));
+}
+
+void TANS::close_files() {
+    file_in.close();
+    file_out.close();
+}
+
+/**
+ * Scale counts to frequencies which sum up to the table size, every present symbol gets at least 1
+ * @param total Sum of counts
+ * @param table_log Logarithm of the table size
+ */
+void TANS::normalize(std::uint64_t total, unsigned table_log) {
+    const std::int64_t table_size = (std::int64_t)1 << table_log;
+    std::int64_t sum = 0;
+    int largest = 0;
+    for (int s = 0; s < 256; s++) {
+        norm[s] = 0;
+        if (counts[s] > 0) {
+            auto scaled = (std::int64_t)std::llround((double)counts[s] * (double)table_size / (double)total);
+            norm[s] = (std::uint32_t)std::max<std::int64_t>(1, scaled);
+        }
+        sum += norm[s];
+        if (counts[s] > counts[largest]) {
+            largest = s;
+        }
+    }
+    // Rounding error goes to the most frequent symbols, where it costs the least
+    std::int64_t diff = table_size - sum;
+    if (diff > 0) {
+        norm[largest] += (std::uint32_t)diff;
+    }
+    while (diff < 0) {
+        int s = (int)(std::max_element(norm, norm + 256) - norm);
+        auto take = std::min<std::int64_t>(-diff, norm[s] - 1);
+        norm[s] -= (std::uint32_t)take;
+        diff += take;
+    }
+}
+
+/**
+ * Distribute symbols over the table according to the normalized frequencies
+ * The step is odd, so every cell of the table is visited once
+ * @param table_log Logarithm of the table size
+ */
+void TANS::spread_symbols(unsigned table_log) {
+    const std::uint32_t table_size = 1u << table_log;
+    const std::uint32_t mask = table_size - 1;
+    const std::uint32_t step = (table_size >> 1) + (table_size >> 3) + 3;
+    spread.resize(table_size);
+    std::uint32_t pos = 0;
+    for (int s = 0; s < 256; s++) {
+        for (std::uint32_t j = 0; j < norm[s]; j++) {
+            spread[pos] = (unsigned char)s;
+            pos = (pos + step) & mask;
+        }
+    }
+}
+
+/**
+ * Encoding table: for the symbol s and the reduced state x in [norm[s], 2 * norm[s])
+ * the next state is encode_table[cumul[s] + x - norm[s]]
+ * @param table_log Logarithm of the table size
+ */
+void TANS::build_encode_table(unsigned table_log) {
+    const std::uint32_t table_size = 1u << table_log;
+    std::uint32_t next[256];
+    std::uint32_t cumul = 0;
+    for (int s = 0; s < 256; s++) {
+        next[s] = cumul;
+        cumul += norm[s];
+    }
+    encode_table.resize(table_size);
+    for (std::uint32_t i = 0; i < table_size; i++) {
+        encode_table[next[spread[i]]++] = (std::uint16_t)(table_size + i);
+    }
+}
+
+/**
+ * Decoding table: state -> symbol, number of bits to read and the base of the next state
+ * @param table_log Logarithm of the table size
+ */
+void TANS::build_decode_table(unsigned table_log) {
+    const std::uint32_t table_size = 1u << table_log;
+    std::uint32_t next[256];
+    std::copy(norm, norm + 256, next);
+    decode_table.resize(table_size);
+    for (std::uint32_t i = 0; i < table_size; i++) {
+        unsigned char s = spread[i];
+        std::uint32_t x = next[s]++;
+        auto nb_bits = (unsigned char)(table_log - (std::bit_width(x) - 1));
+        decode_table[i] = {(std::uint16_t)((x << nb_bits) - table_size), s, nb_bits};
+    }
+}
+
+TANS::TANS(int level): TANS(CodecParams::from_level(level)) {}
+
+TANS::TANS(const CodecParams& params_): params(params_), counts(), norm() {}
+
+/**
+ * tANS encoding of a buffer
+ * Symbols are encoded from the last one, so the decoder gets them in the direct order
+ * @param data Source
+ * @param size Size of the source
+ * @param out Result is appended here
+ */
+void TANS::encode_buffer(const unsigned char* data, std::size_t size, std::vector<unsigned char>& out) {
+    unsigned char buf[10];
+    out.insert(out.end(), buf, buf + uint_to_varint(buf, size));
+    if (size == 0) {
+        return;
+    }
+
+    const unsigned table_log = TABLE_LOG;
+    const std::uint32_t table_size = 1u << table_log;
+    std::fill(counts, counts + 256, 0);
+    for (std::size_t i = 0; i < size; i++) {
+        counts[data[i]]++;
+    }
+    normalize(size, table_log);
+    spread_symbols(table_log);
+    build_encode_table(table_log);
+
+    out.push_back((unsigned char)table_log);
+    for (std::uint32_t freq : norm) {
+        out.insert(out.end(), buf, buf + uint_to_varint(buf, freq));
+    }
+
+    // Number of bits for the symbol is k or k - 1 depending on the state
+    std::uint32_t k[256];
+    std::uint32_t threshold[256];
+    std::int32_t offset[256];
+    std::int32_t cumul = 0;
+    for (int s = 0; s < 256; s++) {
+        if (norm[s] > 0) {
+            k[s] = table_log - (std::bit_width(norm[s]) - 1);
+            threshold[s] = norm[s] << k[s];
+        }
+        offset[s] = cumul - (std::int32_t)norm[s];
+        cumul += (std::int32_t)norm[s];
+    }
+
+    auto bits_buffer = context.buffers.acquire(0);
+    std::vector<unsigned char>& bits = *bits_buffer;
+    bits.reserve(size + 16);
+    std::uint64_t bit_buffer = 0;
+    unsigned bit_count = 0;
+    auto write_bits = [&](std::uint32_t value, unsigned nb_bits) {
+        bit_buffer |= (std::uint64_t)value << bit_count;
+        bit_count += nb_bits;
+        while (bit_count >= 8) {
+            bits.push_back((unsigned char)bit_buffer);
+            bit_buffer >>= 8;
+            bit_count -= 8;
+        }
+    };
+
+    std::uint32_t states[STATES];
+    std::fill(states, states + STATES, table_size);
+    for (std::size_t i = size; i-- > 0;) {
+        std::uint32_t& x = states[i % STATES];
+        unsigned char s = data[i];
+        std::uint32_t nb_bits = k[s] - (x < threshold[s]);
+        write_bits(x & ((1u << nb_bits) - 1), nb_bits);
+        x = encode_table[offset[s] + (std::int32_t)(x >> nb_bits)];
+    }
+    for (std::uint32_t x : states) {
+        write_bits(x - table_size, table_log);
+    }
+    // Marker of the end of the bits
+    write_bits(1, 1);
+    if (bit_count > 0) {
+        bits.push_back((unsigned char)bit_buffer);
+    }
+
+    out.insert(out.end(), buf, buf + uint_to_varint(buf, bits.size()));
+    out.insert(out.end(), bits.begin(), bits.end());
+}
+
+/**
+ * tANS decoding of a buffer produced by encode_buffer
+ * Bits are read backwards from the end marker, one table lookup per symbol
+ * The declared size is checked against max_size before the result is allocated
+ * @param in Source, moved past the encoded data
+ * @param end End of the source
+ * @param out Result is appended here
+ * @param max_size Maximal size of the result
+ * @return False if the source is malformed or the result is longer than max_size
+ */
+bool TANS::decode_buffer(const unsigned char*& in, const unsigned char* end, std::vector<unsigned char>& out,
+                         std::uint64_t max_size) {
+    std::uint64_t size;
+    if (!varint_to_uint(in, end, size)) {
+        return false;
+    }
+    if (size == 0) {
+        return true;
+    }
+    if (in == end || size > max_size) {
+        return false;
+    }
+    const unsigned table_log = *in++;
+    if (table_log < 8 || table_log > 15) {
+        return false;
+    }
+    const std::uint32_t table_size = 1u << table_log;
+    std::uint64_t sum = 0;
+    for (std::uint32_t& freq : norm) {
+        std::uint64_t value;
+        if (!varint_to_uint(in, end, value) || value > table_size) {
+            return false;
+        }
+        freq = (std::uint32_t)value;
+        sum += value;
+    }
+    std::uint64_t bits_size;
+    if (sum != table_size || !varint_to_uint(in, end, bits_size) || bits_size == 0 ||
+        bits_size > (std::uint64_t)(end - in) || in[bits_size - 1] == 0) {
+        return false;
+    }
+    spread_symbols(table_log);
+    build_decode_table(table_log);
+
+    const unsigned char* bits = in;
+    std::uint64_t bit_pos = (bits_size - 1) * 8 + (std::bit_width(bits[bits_size - 1]) - 1);
+    bool overflow = false;
+    auto read_bits = [&](unsigned nb_bits) -> std::uint32_t {
+        if (nb_bits > bit_pos) {
+            overflow = true;
+            return 0;
+        }
+        bit_pos -= nb_bits;
+        std::uint64_t byte = bit_pos / 8;
+        std::uint64_t word = 0;
+        if (byte + 8 <= bits_size) {
+            std::memcpy(&word, bits + byte, 8);
+        }
+        else {
+            for (std::uint64_t b = byte; b < bits_size; b++) {
+                word |= (std::uint64_t)bits[b] << (8 * (b - byte));
+            }
+        }
+        return (std::uint32_t)((word >> (bit_pos % 8)) & ((1u << nb_bits) - 1));
+    };
+
+    std::uint32_t states[STATES];
+    for (unsigned j = STATES; j-- > 0;) {
+        states[j] = read_bits(table_log);
+    }
+    std::size_t out_pos = out.size();
+    out.resize(out_pos + size);
+    unsigned char* dst = out.data() + out_pos;
+    const DecodeEntry* table = decode_table.data();
+    std::uint64_t i = 0;
+    for (; i + STATES <= size; i += STATES) {
+        for (unsigned j = 0; j < STATES; j++) {
+            DecodeEntry e = table[states[j]];
+            dst[i + j] = e.symbol;
+            states[j] = e.base + read_bits(e.nb_bits);
+        }
+    }
+    for (unsigned j = 0; i < size; i++, j++) {
+        DecodeEntry e = table[states[j]];
+        dst[i] = e.symbol;
+        states[j] = e.base + read_bits(e.nb_bits);
+    }
+
+    in += bits_size;
+    // The encoder started from state 0 and all bits must be consumed
+    for (std::uint32_t x : states) {
+        if (x != 0) {
+            return false;
+        }
+    }
+    return !overflow && bit_pos == 0;
+}
+
+/**
+ * tANS encoding for the file
+ * The file starts with the parameters, then each block is stored as varint size of the encoded block,
+ * varint stride of the filter (if the filter is on), the block in encode_buffer format and the checksum
+ * of the encoded block.
+ * Size 0 ends the blocks and is followed by the checksum of the whole source
+ * @param filename Name of the file
+ */
+void TANS::encode(const std::string& filename) {
+    open_files_analysis(filename);
+    write_params(file_out, params);
+    Checksum block_checksum(params.checksum);
+    Checksum stream_checksum(params.checksum);
+    auto data = context.buffers.acquire(params.block_size);
+    auto encoded_buffer = context.buffers.acquire(0);
+    std::vector<unsigned char>& encoded = *encoded_buffer;
+    auto filtered = context.buffers.acquire(params.filter != FilterKind::None ? params.block_size : 0);
+    std::size_t data_size;
+    while ((data_size = file_in.read((char*)data->data(), data->size())) > 0) {
+        stream_checksum.update(data->data(), data_size);
+        const unsigned char* block = data->data();
+        unsigned stride = block_filter_stride(params, block, data_size);
+        if (stride != 0) {
+            filter_forward(params.filter, stride, block, data_size, filtered->data());
+            block = filtered->data();
+        }
+        encoded.clear();
+        encode_buffer(block, data_size, encoded);
+        write_varint(file_out, encoded.size());
+        if (params.filter != FilterKind::None) {
+            write_varint(file_out, stride);
+        }
+        file_out.write((char*)encoded.data(), encoded.size());
+        block_checksum.reset();
+        block_checksum.update(encoded.data(), encoded.size());
+        block_checksum.write(file_out);
+    }
+    write_varint(file_out, 0);
+    stream_checksum.write(file_out);
+    close_files();
+}
+
+/**
+ * Read the next encoded block and check its checksum
+ * @param encoded Result
+ * @param stride Stride of the filter of the block, 0 - not filtered
+ * @return False after the last block
+ */
+bool TANS::read_block(std::vector<unsigned char>& encoded, unsigned& stride) {
+    std::uint64_t encoded_size;
+    std::uint64_t block_stride = 0;
+    if (!read_varint(file_in, encoded_size)) {
+        throw std::runtime_error("TANS: truncated file");
+    }
+    if (encoded_size == 0) {
+        return false;
+    }
+    if (encoded_size > 2 * params.block_size + 4096 ||
+        (params.filter != FilterKind::None && !read_varint(file_in, block_stride)) || block_stride > MAX_FILTER_STRIDE) {
+        throw std::runtime_error("TANS: corrupted block header");
+    }
+    stride = (unsigned)block_stride;
+    encoded.resize(encoded_size);
+    if (file_in.read((char*)encoded.data(), encoded_size) != encoded_size) {
+        throw std::runtime_error("TANS: truncated block");
+    }
+    Checksum block_checksum(params.checksum);
+    block_checksum.update(encoded.data(), encoded.size());
+    if (!block_checksum.check(file_in)) {
+        throw std::runtime_error("TANS: block checksum mismatch");
+    }
+    return true;
+}
+
+/**
+ * tANS decoding for the file, the checksums are checked along the way
+ * @param filename Name of the file
+ */
+void TANS::decode(const std::string& filename) {
+    open_files_decompress(filename);
+    CodecParams file_params;
+    if (!read_params(file_in, file_params)) {
+        throw std::runtime_error("TANS: invalid header");
+    }
+    ScopedParams scoped_params(params, file_params);
+    Checksum stream_checksum(params.checksum);
+    auto encoded_buffer = context.buffers.acquire(0);
+    auto data_buffer = context.buffers.acquire(0);
+    auto filtered = context.buffers.acquire(0);
+    std::vector<unsigned char>& encoded = *encoded_buffer;
+    std::vector<unsigned char>& data = *data_buffer;
+    unsigned stride;
+    while (read_block(encoded, stride)) {
+        const unsigned char* in = encoded.data();
+        data.clear();
+        if (!decode_buffer(in, in + encoded.size(), data, params.block_size)) {
+            throw std::runtime_error("TANS: corrupted block");
+        }
+        const unsigned char* block = data.data();
+        if (stride != 0) {
+            filtered->resize(data.size());
+            filter_inverse(params.filter, stride, block, data.size(), filtered->data());
+            block = filtered->data();
+        }
+        stream_checksum.update(block, data.size());
+        file_out.write((const char*)block, data.size());
+    }
+    if (!stream_checksum.check(file_in)) {
+        throw std::runtime_error("TANS: checksum mismatch");
+    }
+    close_files();
+}
+
+/**
+ * Check the checksums of the blocks without decoding them
+ * @param filename Name of the file
+ */
+void TANS::verify(const std::string& filename) {
+    file_in.open(filename);
+    CodecParams file_params;
+    if (!read_params(file_in, file_params)) {
+        throw std::runtime_error("TANS: invalid header");
+    }
+    ScopedParams scoped_params(params, file_params);
+    auto encoded = context.buffers.acquire(0);
+    unsigned stride;
+    while (read_block(*encoded, stride)) {}
+    // The checksum of the source can be checked only by decode
+    char stored[8];
+    std::size_t stored_size = Checksum(params.checksum).size();
+    if (file_in.read(stored, stored_size) != stored_size) {
+        throw std::runtime_error("TANS: truncated file");
+    }
+    file_in.close();
+}
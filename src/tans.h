@@ -0,0 +1,111 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "async_io.h"
+#include "params.h"
+#include "context.h"
+
+/**
+ * Table-based asymmetric numeral systems (tANS) entropy coder
+ * Drop-in alternative to Huffman: same buffer interface, fractional bits per symbol
+ */
+class TANS {
+private:
+    // Size of the state table is 2 ^ TABLE_LOG
+    const unsigned TABLE_LOG = 12;
+    // Number of interleaved states
+    static constexpr unsigned STATES = 4;
+
+    struct DecodeEntry {
+        std::uint16_t base;
+        unsigned char symbol;
+        unsigned char nb_bits;
+    };
+
+    CodecParams params;
+    AsyncReader file_in;
+    AsyncWriter file_out;
+
+    std::uint64_t counts[256];
+    std::uint32_t norm[256];
+    std::vector<unsigned char> spread;
+    std::vector<std::uint16_t> encode_table;
+    std::vector<DecodeEntry> decode_table;
+    // Bits of the encoder and the blocks of the file
+    CodecContext context;
+
+    void open_files_analysis(const std::string& filename);
+
+    void open_files_decompress(const std::string& filename);
+
+    void close_files();
+
+    /**
+     * Scale counts to frequencies which sum up to the table size, every present symbol gets at least 1
+     * @param total Sum of counts
+     * @param table_log Logarithm of the table size
+     */
+    void normalize(std::uint64_t total, unsigned table_log);
+
+    /**
+     * Distribute symbols over the table according to the normalized frequencies
+     * @param table_log Logarithm of the table size
+     */
+    void spread_symbols(unsigned table_log);
+
+    void build_encode_table(unsigned table_log);
+
+    void build_decode_table(unsigned table_log);
+
+    /**
+     * Read the next encoded block and check its checksum
+     * @param encoded Result
+     * @param stride Stride of the filter of the block, 0 - not filtered
+     * @return False after the last block
+     */
+    bool read_block(std::vector<unsigned char>& encoded, unsigned& stride);
+
+public:
+    explicit TANS(int level = CodecParams::DEFAULT_LEVEL);
+
+    explicit TANS(const CodecParams& params_);
+
+    /**
+     * tANS encoding of a buffer
+     * Format: varint number of symbols, table log, varint normalized frequencies, varint size of the bits, bits
+     * @param data Source
+     * @param size Size of the source
+     * @param out Result is appended here
+     */
+    void encode_buffer(const unsigned char* data, std::size_t size, std::vector<unsigned char>& out);
+
+    /**
+     * tANS decoding of a buffer produced by encode_buffer
+     * @param in Source, moved past the encoded data
+     * @param end End of the source
+     * @param out Result is appended here
+     * @param max_size Maximal size of the result
+     * @return False if the source is malformed or the result is longer than max_size
+     */
+    bool decode_buffer(const unsigned char*& in, const unsigned char* end, std::vector<unsigned char>& out,
+                       std::uint64_t max_size);
+
+    /**
+     * tANS encoding for the file, block by block
+     * @param filename Name of the file
+     */
+    void encode(const std::string& filename);
+
+    /**
+     * tANS decoding for the file
+     * @param filename Name of the file
+     */
+    void decode(const std::string& filename);
+
+    /**
+     * Check the file without decoding it, throws std::runtime_error if it is damaged
+     * @param filename Name of the file
+     */
+    void verify(const std::string& filename);
+};
@@ -0,0 +1,84 @@
+#include "thread_pool.h"
+
+#include <utility>
+
+ThreadPool::ThreadPool(unsigned threads): generation(0), stopping(false), running(0), call(nullptr),
+                                          context(nullptr), count(0), next(0) {
+    for (unsigned i = 0; i < threads; i++) {
+        workers.emplace_back(&ThreadPool::worker_loop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+unsigned ThreadPool::size() const {
+    return (unsigned)workers.size() + 1;
+}
+
+void ThreadPool::worker_loop() {
+    std::uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+        }
+        work();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--running == 0) {
+            done.notify_one();
+        }
+    }
+}
+
+/**
+ * Take indices of the current loop until there are none left
+ * After an exception the remaining indices are skipped
+ */
+void ThreadPool::work() {
+    std::size_t i;
+    while ((i = next.fetch_add(1, std::memory_order_relaxed)) < count) {
+        try {
+            call(context, i);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            next.store(count, std::memory_order_relaxed);
+        }
+    }
+}
+
+void ThreadPool::run(std::size_t count_, void (*call_)(void*, std::size_t), void* context_) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        call = call_;
+        context = context_;
+        count = count_;
+        next.store(0, std::memory_order_relaxed);
+        error = nullptr;
+        running = workers.size();
+        generation++;
+    }
+    start.notify_all();
+    work();
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return running == 0; });
+    if (error) {
+        std::rethrow_exception(std::exchange(error, nullptr));
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed set of worker threads for data-parallel loops
+ * The calling thread works too, so a pool without workers runs everything in place
+ */
+class ThreadPool {
+private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start;
+    std::condition_variable done;
+    // Incremented for every loop, workers wait for a new one
+    std::uint64_t generation;
+    bool stopping;
+    std::size_t running;
+
+    // Current loop: task(context, i) for i < count, next is the first index which is not taken yet
+    void (*call)(void*, std::size_t);
+    void* context;
+    std::size_t count;
+    std::atomic<std::size_t> next;
+    std::exception_ptr error;
+
+    void worker_loop();
+
+    /**
+     * Take indices of the current loop until there are none left
+     */
+    void work();
+
+    void run(std::size_t count_, void (*call_)(void*, std::size_t), void* context_);
+
+public:
+    /**
+     * @param threads Number of worker threads in addition to the calling one
+     */
+    explicit ThreadPool(unsigned threads);
+
+    ThreadPool(const ThreadPool&) = delete;
+
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool();
+
+    /**
+     * Number of threads which run the loops, including the calling one
+     */
+    unsigned size() const;
+
+    /**
+     * Call task(i) for every i < count_, returns when all calls are finished
+     * The first exception thrown by a task is rethrown here
+     * @param count_ Number of calls
+     * @param task Function of the index, called from several threads at once
+     */
+    template <typename Task>
+    void parallel_for(std::size_t count_, Task& task) {
+        if (workers.empty() || count_ <= 1) {
+            for (std::size_t i = 0; i < count_; i++) {
+                task(i);
+            }
+            return;
+        }
+        run(count_, [](void* task_, std::size_t i) {
+            (*static_cast<Task*>(task_))(i);
+        }, &task);
+    }
+};
@@ -1,9 +1,12 @@
 #include "utils.h"
 
-const std::string modes[3] {
+const std::string modes[6] {
     "_lzw.opt_lzw",
     "_rle.opt_rle",
-    "_huf.opt_huf"
+    "_huf.opt_huf",
+    "_lz77.opt_lz77",
+    "_ans.opt_ans",
+    "_cdc.opt_cdc"
 };
 
 std::pair<std::string, std::string> split_filename(const std::string& filename, char delimiter) {
@@ -122,3 +125,43 @@ void int_to_chars(unsigned char* k_chars, unsigned int a) {
     a /= 256;
     k_chars[0] = a % 256;
 }
+
+unsigned char uint_to_varint(unsigned char* out, std::uint64_t a) {
+    unsigned char length = 0;
+    while (a >= 128) {
+        out[length++] = (unsigned char)(a | 128);
+        a >>= 7;
+    }
+    out[length++] = (unsigned char)a;
+    return length;
+}
+
+bool varint_to_uint(const unsigned char*& in, const unsigned char* end, std::uint64_t& a) {
+    a = 0;
+    for (int shift = 0; shift < 64 && in != end; shift += 7) {
+        unsigned char byte = *in++;
+        a |= (std::uint64_t)(byte & 127) << shift;
+        if (!(byte & 128)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void write_varint(AsyncWriter& file_out, std::uint64_t a) {
+    unsigned char buf[10];
+    unsigned char length = uint_to_varint(buf, a);
+    file_out.write((char*)buf, length);
+}
+
+bool read_varint(AsyncReader& file_in, std::uint64_t& a) {
+    a = 0;
+    char byte;
+    for (int shift = 0; shift < 64 && file_in.get(byte); shift += 7) {
+        a |= (std::uint64_t)((unsigned char)byte & 127) << shift;
+        if (!((unsigned char)byte & 128)) {
+            return true;
+        }
+    }
+    return false;
+}
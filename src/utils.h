@@ -1,7 +1,9 @@
 #pragma once
 #include <string>
 #include <climits>
+#include <cstdint>
 #include <fstream>
+#include "async_io.h"
 
 std::pair<std::string, std::string> split_filename(const std::string& filename, char delimiter);
 
@@ -17,3 +19,23 @@ unsigned int chars_to_int(const unsigned char* a);
 
 void int_to_chars(unsigned char* k_chars, unsigned int a);
 
+/**
+ * Write LEB128 varint (7 bits per byte, high bit - continuation)
+ * @param out Destination, at least 10 bytes
+ * @param a Number
+ * @return Number of bytes written
+ */
+unsigned char uint_to_varint(unsigned char* out, std::uint64_t a);
+
+/**
+ * Read LEB128 varint
+ * @param in Source, moved past the varint
+ * @param end End of the source
+ * @param a Result
+ * @return False if the varint is truncated or too long
+ */
+bool varint_to_uint(const unsigned char*& in, const unsigned char* end, std::uint64_t& a);
+
+void write_varint(AsyncWriter& file_out, std::uint64_t a);
+
+bool read_varint(AsyncReader& file_in, std::uint64_t& a);